@@ -0,0 +1,217 @@
+/*
+ * Lone Dynamics Device Programmer - Linux hidraw interface
+ * Copyright (c) 2021 Lone Dynamics Corporation. All rights reserved.
+ *
+ * Drop-in replacement for hidapi.c on Linux that implements only the calls
+ * ldprog makes, directly on /dev/hidrawN: devices are found through sysfs
+ * (no udev), feature reports are single ioctls and interrupt reports plain
+ * read/write on the caller's buffer, without any error bookkeeping:
+ *
+ *   make musli_hidapi
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <wchar.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/hidraw.h>
+
+#include "hidapi.h"
+
+#ifndef HIDIOCSFEATURE
+#define HIDIOCSFEATURE(len) _IOC(_IOC_WRITE|_IOC_READ, 'H', 0x06, len)
+#endif
+#ifndef HIDIOCGFEATURE
+#define HIDIOCGFEATURE(len) _IOC(_IOC_WRITE|_IOC_READ, 'H', 0x07, len)
+#endif
+
+#define HIDRAW_SYSFS "/sys/class/hidraw"
+
+struct hid_device_ {
+	int fd;
+};
+
+// read HID_ID (bus:vendor:product) and HID_UNIQ (serial) from the uevent of
+// a hidraw node's sysfs directory; returns 0 if it belongs to a HID device
+
+static int hidraw_ids(const char *dir, unsigned short *vid,
+		unsigned short *pid, char *serial, size_t len) {
+
+	char path[512];
+	char line[256];
+	unsigned int bus, v, p;
+	int found = 0;
+
+	snprintf(path, sizeof(path), "%s/device/uevent", dir);
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) return -1;
+
+	serial[0] = 0x00;
+
+	while (fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\n")] = 0x00;
+		if (sscanf(line, "HID_ID=%x:%x:%x", &bus, &v, &p) == 3) {
+			*vid = v;
+			*pid = p;
+			found = 1;
+		} else if (!strncmp(line, "HID_UNIQ=", 9)) {
+			snprintf(serial, len, "%s", line + 9);
+		}
+	}
+
+	fclose(fp);
+	return found ? 0 : -1;
+
+}
+
+// serial numbers are plain ASCII, widen them character by character
+
+static wchar_t *serial_dup(const char *serial) {
+	size_t len = strlen(serial);
+	wchar_t *w = malloc((len + 1) * sizeof(wchar_t));
+	for (size_t i = 0; i <= len; i++)
+		w[i] = (unsigned char)serial[i];
+	return w;
+}
+
+// vendor_id/product_id 0 match any device, like hidapi
+
+struct hid_device_info HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
+		unsigned short product_id) {
+
+	DIR *dir = opendir(HIDRAW_SYSFS);
+	struct dirent *de;
+	struct hid_device_info *devs = NULL;
+	struct hid_device_info **tail = &devs;
+	char path[512];
+	char serial[128];
+	unsigned short vid, pid;
+
+	if (dir == NULL) return NULL;
+
+	while ((de = readdir(dir)) != NULL) {
+
+		if (strncmp(de->d_name, "hidraw", 6)) continue;
+		snprintf(path, sizeof(path), HIDRAW_SYSFS "/%s", de->d_name);
+		if (hidraw_ids(path, &vid, &pid, serial, sizeof(serial)))
+			continue;
+		if ((vendor_id && vid != vendor_id) || (product_id && pid != product_id))
+			continue;
+
+		struct hid_device_info *d = calloc(1, sizeof(struct hid_device_info));
+		snprintf(path, sizeof(path), "/dev/%s", de->d_name);
+		d->path = strdup(path);
+		d->vendor_id = vid;
+		d->product_id = pid;
+		d->serial_number = serial_dup(serial);
+		d->interface_number = -1;
+		*tail = d;
+		tail = &d->next;
+
+	}
+
+	closedir(dir);
+	return devs;
+
+}
+
+void HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs) {
+	while (devs != NULL) {
+		struct hid_device_info *next = devs->next;
+		free(devs->path);
+		free(devs->serial_number);
+		free(devs);
+		devs = next;
+	}
+}
+
+hid_device * HID_API_EXPORT hid_open_path(const char *path) {
+	int fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0) return NULL;
+	hid_device *dev = malloc(sizeof(struct hid_device_));
+	dev->fd = fd;
+	return dev;
+}
+
+hid_device * HID_API_EXPORT hid_open(unsigned short vendor_id,
+		unsigned short product_id, const wchar_t *serial_number) {
+
+	struct hid_device_info *devs = hid_enumerate(vendor_id, product_id);
+	hid_device *dev = NULL;
+
+	for (struct hid_device_info *d = devs; d != NULL && dev == NULL;
+			d = d->next) {
+		if (serial_number != NULL && wcscmp(d->serial_number, serial_number))
+			continue;
+		dev = hid_open_path(d->path);
+		if (dev == NULL) perror(d->path);
+	}
+
+	hid_free_enumeration(devs);
+	return dev;
+
+}
+
+// the serial of an open device, from the sysfs node behind its fd
+
+int HID_API_EXPORT_CALL hid_get_serial_number_string(hid_device *dev,
+		wchar_t *string, size_t maxlen) {
+
+	struct stat st;
+	char path[64];
+	char serial[128];
+	unsigned short vid, pid;
+	size_t i;
+
+	if (maxlen == 0 || fstat(dev->fd, &st) < 0) return -1;
+	snprintf(path, sizeof(path), "/sys/dev/char/%u:%u", major(st.st_rdev),
+		minor(st.st_rdev));
+	if (hidraw_ids(path, &vid, &pid, serial, sizeof(serial))) return -1;
+
+	for (i = 0; serial[i] && i < maxlen - 1; i++)
+		string[i] = (unsigned char)serial[i];
+	string[i] = 0;
+	return 0;
+
+}
+
+void HID_API_EXPORT hid_close(hid_device *dev) {
+	if (dev == NULL) return;
+	close(dev->fd);
+	free(dev);
+}
+
+int HID_API_EXPORT hid_send_feature_report(hid_device *dev,
+		const unsigned char *data, size_t length) {
+	return ioctl(dev->fd, HIDIOCSFEATURE(length), data);
+}
+
+int HID_API_EXPORT hid_get_feature_report(hid_device *dev,
+		unsigned char *data, size_t length) {
+	return ioctl(dev->fd, HIDIOCGFEATURE(length), data);
+}
+
+int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data,
+		size_t length) {
+	return write(dev->fd, data, length);
+}
+
+// the device going away shows up as POLLERR/POLLHUP rather than as an error
+// from read(), so check for that like hidapi does
+
+int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data,
+		size_t length, int milliseconds) {
+	struct pollfd fds = { .fd = dev->fd, .events = POLLIN };
+	int r = poll(&fds, 1, milliseconds);
+	if (r <= 0) return r;
+	if (fds.revents & (POLLERR | POLLHUP | POLLNVAL)) return -1;
+	return read(dev->fd, data, length);
+}
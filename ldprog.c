@@ -3,108 +3,487 @@
  * Copyright (c) 2021 Lone Dynamics Corporation. All rights reserved.
  */
 
+#define _GNU_SOURCE		// sched_setaffinity
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <strings.h>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define MUSLI_CMD_READY 0x00
 #define MUSLI_CMD_INIT 0x01
+#define MUSLI_CMD_SYNC 0x02
 #define MUSLI_CMD_GPIO_SET_DIR 0x10
 #define MUSLI_CMD_GPIO_DISABLE_PULLS 0x11
 #define MUSLI_CMD_GPIO_PULL_UP 0x12
 #define MUSLI_CMD_GPIO_PULL_DOWN 0x13
 #define MUSLI_CMD_GPIO_GET 0x20
 #define MUSLI_CMD_GPIO_PUT 0x21
+#define MUSLI_CMD_GPIO_SET_MASK 0x22
+#define MUSLI_CMD_GPIO_GET_ALL 0x23
 #define MUSLI_CMD_SPI_READ 0x80
 #define MUSLI_CMD_SPI_WRITE 0x81
+#define MUSLI_CMD_SPI_XFER 0x82
+#define MUSLI_CMD_CFG_SPI_CLK 0x8e
 #define MUSLI_CMD_CFG_PIO_SPI 0x8f
+#define MUSLI_CMD_BUF_WRITE 0xa0
+#define MUSLI_CMD_FLASH_PROG_SECTOR 0xa1
+#define MUSLI_CMD_FLASH_CRC32 0xa2
+#define MUSLI_CMD_FLASH_WAIT 0xa3
 #define MUSLI_CMD_RESET 0xf0
 
+// MUSLI_CMD_READY reply (firmware with capability support):
+// 'M' 'U' <version> <max payload> <spi clock mask> <caps, 32-bit LE>
+// [<max reply>]; older firmware doesn't answer or answers without the
+// magic, without max reply the replies are limited to max payload
+#define MUSLI_READY_LEN 9
+#define MUSLI_READY_MAX_LEN 10
+#define MUSLI_READY_TIMEOUT 100	// ms
+
+// SPI clocks selectable with MUSLI_CMD_CFG_SPI_CLK (index = bit in mask)
+#define MUSLI_SPI_CLKS { 1000, 2000, 4000, 8000, 12000, 16000, 24000, 32000 }
+
+// capability bits
+#define MUSLI_CAP_PROG_SECTOR	(1 << 0)	// BUF_WRITE + FLASH_PROG_SECTOR
+#define MUSLI_CAP_CRC32			(1 << 1)	// FLASH_CRC32
+#define MUSLI_CAP_FLASH_WAIT		(1 << 2)	// FLASH_WAIT
+#define MUSLI_CAP_GPIO_MASK		(1 << 3)	// GPIO_SET_MASK + GPIO_GET_ALL
+#define MUSLI_CAP_SPI_XFER		(1 << 4)	// SPI_XFER
+#define MUSLI_CAP_HID_STREAM		(1 << 5)	// HID interrupt reports
+#define MUSLI_CAP_HID_SYNC		(1 << 6)	// SYNC + HID sequence numbers
+
+// MUSLI_CMD_FLASH_PROG_SECTOR (args: addr[23:16] addr[15:8] addr[7:0])
+// programs the 4K sector uploaded with MUSLI_CMD_BUF_WRITE: erase, page
+// program and WIP polling run on the device; reply: <status> <crc32 LE>
+// where crc32 is computed over the sector as read back from the flash
+#define MUSLI_SECTOR_SIZE 4096
+#define MUSLI_SECTOR_REPLY_LEN 5
+#define MUSLI_SECTOR_TIMEOUT 3000	// ms
+
+// MUSLI_CMD_FLASH_CRC32 (args: addr[23:16] addr[15:8] addr[7:0],
+// payload: length, 32-bit LE) reads the range with 0x03 on the device;
+// reply: <status> <crc32 LE>
+#define MUSLI_CRC_REPLY_LEN 5
+#define MUSLI_CRC_TIMEOUT 2000	// ms
+
+// MUSLI_CMD_FLASH_WAIT (args: status mask, timeout in ms, 16-bit LE) polls
+// the flash status register on the device until (status & mask) == 0;
+// reply: <status> <1 if timed out> <elapsed us, 32-bit LE>
+#define MUSLI_WAIT_REPLY_LEN 6
+#define MUSLI_WAIT_TIMEOUT 10000	// ms, per request
+
+// MUSLI_CMD_GPIO_SET_MASK (payload: dir mask, dir, out mask, out; 32-bit LE
+// each) sets the direction of the pins in dir mask (1 = output), then drives
+// the pins in out mask, in one step; MUSLI_CMD_GPIO_GET_ALL replies with
+// the level of every pin (32-bit LE)
+#define MUSLI_GPIO_MASK_LEN 16
+
+// MUSLI_CMD_SPI_XFER (args: write length, read length, SS pin | flags;
+// payload: the bytes to write) asserts SS, writes, clocks the read length
+// back and releases SS, all in one exchange; reply: the bytes read
+#define MUSLI_XFER_PIN 0x1f
+#define MUSLI_XFER_HOLD 0x20		// leave SS asserted afterwards
+#define MUSLI_XFER_CONT 0x40		// SS is still asserted from the last one
+#define MUSLI_XFER_SS_HIGH 0x80	// SS is active high
+#define MUSLI_XFER_TIMEOUT 1000	// ms
+
+// with MUSLI_CAP_HID_SYNC every HID request carries a 7-bit sequence number
+// in bits 7..1 of its status byte and commands without a reply are not
+// acked; MUSLI_CMD_SYNC replies: <failed commands since the last sync>
+// <seq> <cmd> <error code> (of the first one that failed) and clears them
+#define MUSLI_SYNC_REPLY_LEN 4
+
+// --
+// transports
+// --
+
+// what a transport can do; the musli_* operations below only exist on
+// transports with compound (musli protocol) commands, the device-side
+// commands they offer are in musli_caps once the firmware has been probed
+
+struct transport_caps {
+	uint32_t max_payload;	// SPI bytes per command (0 = no limit)
+	uint32_t blk_size;		// payload used until the firmware says otherwise
+	uint32_t max_reply;		// reply bytes per command (0 = max_payload)
+	int async;					// keeps transfers in flight between begin/end
+	int compound;				// speaks the musli protocol
+	int init_release;			// hands the pins back with MUSLI_CMD_INIT 1/3
+	uint8_t pins;				// pin numbers it takes are below this
+	uint8_t ss, so, si, sck, cdone, creset;	// default wiring
+};
+
+// the spi_* operations move whole buffers (buf == NULL writes zeros) so
+// that nothing is dispatched per byte; begin, end and gpio_read_all are
+// optional
+
+struct transport {
+	const char *name;
+	int (*open)(void);		// 0 if a device was found
+	void (*close)(void);
+	void (*list)(void);
+	void (*gpio_mode)(uint8_t pin, uint8_t dir);
+	void (*gpio_write)(uint8_t pin, uint8_t val);
+	uint8_t (*gpio_read)(uint8_t pin);
+	uint64_t (*gpio_read_all)(void);
+	void (*spi_write)(const uint8_t *buf, uint32_t len);
+	void (*spi_read)(uint8_t *buf, uint32_t len);
+	void (*begin)(void);
+	void (*end)(void);
+	void (*musli_cmd)(uint8_t cmd, uint8_t arg1, uint8_t arg2, uint8_t arg3,
+		const uint8_t *data, uint8_t dlen);
+	void (*musli_out)(uint8_t cmd, const uint8_t *buf, uint32_t len);
+	int (*musli_query)(uint8_t cmd, uint8_t arg1, uint8_t arg2, uint8_t arg3,
+		const uint8_t *data, uint8_t dlen, uint8_t *reply, int len, int timeout);
+	struct transport_caps caps;
+};
+
+struct transport *tp = NULL;
+
+#define GPIO_WRITE(pin, val) tp->gpio_write(pin, val)
+#define GPIO_READ(pin) tp->gpio_read(pin)
+#define GPIO_SET_MODE(pin, dir) tp->gpio_mode(pin, dir)
+
+#define USB_MFG_ID 0x2e8a
+#define USB_DEV_ID 0x1025
+
 #ifdef BACKEND_PIGPIO
 
- #include <pigpio.h>
- #define GPIO_WRITE gpioWrite
- #define GPIO_READ gpioRead
- #define GPIO_SET_MODE gpioSetMode
+ #ifdef PIGPIO_SIM
+  #include "pigpio_sim.h"
+ #else
+  #include <pigpio.h>
+ #endif
+ int pigpioOpen(void);
+ void pigpioClose(void);
+ void pigpioSetMode(uint8_t pin, uint8_t dir);
+ void pigpioWrite(uint8_t pin, uint8_t val);
+ uint8_t pigpioRead(uint8_t pin);
+ uint64_t pigpioReadAll(void);
+ void pigpioSpiWrite(const uint8_t *buf, uint32_t len);
+ void pigpioSpiRead(uint8_t *buf, uint32_t len);
+ int pigpioSpiHw(void);
+ uint32_t pigpioWaveWrite(const uint8_t *buf, uint32_t len);
+ void pigpioWaveWait(uint32_t poll_us);
+ extern struct transport transport_pigpio;
+ #define PIGPIO_SPI_KHZ 8000		// hardware SPI clock unless -F says otherwise
+ #define PIGPIO_SPI_CHUNK 65536	// bytes per spiWrite/spiRead
+ #define PIGPIO_SPI_MISO 9		// SPI0 pins
+ #define PIGPIO_SPI_MOSI 10
+ #define PIGPIO_SPI_SCLK 11
+ int pigpio_spi = -1;				// spiOpen handle
+ int pigpio_spi_failed = 0;
+ char pigpio_spi_zero[PIGPIO_SPI_CHUNK];	// sent for buf == NULL
+ char pigpio_spi_drop[PIGPIO_SPI_CHUNK];	// read into for buf == NULL
+ #define PIGPIO_WAVE_BYTES 128	// bytes per DMA waveform (two pulses a bit)
+ #define PIGPIO_WAVE_MIN 1024		// shorter writes are bit banged
+ gpioPulse_t pigpio_pulses[PIGPIO_WAVE_BYTES * 16];
+ #define PIGPIO_STALL_NS 100000	// bit banged bytes slower than this (-L)
+ struct pigpio_stat {
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t min_ns;
+	uint64_t max_ns;
+	uint64_t stalls;
+ } pigpio_stats = { 0, 0, UINT64_MAX, 0, 0 };
+ void pigpio_stat(uint64_t ns);
 
- #define CSPI_SS	25
- #define CSPI_SO	9
- #define CSPI_SI	10
- #define CSPI_SCK	11
- #define CRESET	23
- #define CDONE		24
+#endif
 
-#elif BACKEND_LIBUSB
+#ifdef BACKEND_SPIDEV
+
+ #include <fcntl.h>
+ #include <sys/ioctl.h>
+ #include <linux/gpio.h>
+ #include <linux/spi/spidev.h>
+ int spidevOpen(void);
+ void spidevClose(void);
+ void spidevSetMode(uint8_t pin, uint8_t dir);
+ void spidevWrite(uint8_t pin, uint8_t val);
+ uint8_t spidevRead(uint8_t pin);
+ uint64_t spidevReadAll(void);
+ void spidevSpiWrite(const uint8_t *buf, uint32_t len);
+ void spidevSpiRead(uint8_t *buf, uint32_t len);
+ int spidevSpiHw(void);
+ int spidevOwned(uint8_t pin);
+ int spidevLine(uint8_t pin);
+ int spidevRequest(const uint8_t *pins, int n);
+ int spidevConfig(int r);
+ void spidevSet(int r, uint64_t mask, uint64_t bits);
+ uint64_t spidevGet(int r, uint64_t mask);
+ void spidevOutputs(int r, uint64_t mask);
+ extern struct transport transport_spidev;
+ #define SPIDEV_CHIP "/dev/gpiochip0"	// unless -G
+ #define SPIDEV_DEV "/dev/spidev0.0"		// unless -Y
+ #define SPIDEV_KHZ 8000					// unless -F
+ #define SPIDEV_BUFSIZ_PATH "/sys/module/spidev/parameters/bufsiz"
+ #define SPIDEV_BUFSIZ 4096				// spidev's default limit per message
+ #define SPIDEV_REQS 16
+ int spidev_chip = -1;				// gpiochip fd
+ int spidev_fd = -1;					// spidev fd, -1 = bit banging
+ uint32_t spidev_bufsiz = SPIDEV_BUFSIZ;
+ uint8_t *spidev_zero = NULL;		// sent for buf == NULL
+ uint8_t *spidev_drop = NULL;		// read into for buf == NULL
+ struct spidev_req {
+	int fd;							// line request
+	uint64_t out;					// lines configured as outputs
+	uint64_t in;					// lines configured as inputs
+	uint64_t val;					// levels of the outputs
+ } spidev_reqs[SPIDEV_REQS];
+ int spidev_nreqs = 0;
+ uint8_t spidev_req_of[256];		// request + 1 of each line, 0 = not requested
+ uint8_t spidev_bit_of[256];		// its bit in that request
 
- #include <libusb-1.0/libusb.h>
- #define GPIO_WRITE musliWrite
- #define GPIO_READ musliRead
- #define GPIO_SET_MODE musliSetMode
+#endif
+
+#ifndef PI_INPUT
  #define PI_INPUT 0
  #define PI_OUTPUT 1
- #define USB_MFG_ID 0x2e8a
- #define USB_DEV_ID 0x1025
- #define CSPI_SS	9
- #define CSPI_SO	8
- #define CSPI_SI	11
- #define CSPI_SCK	10
- #define CDONE		2
- #define CRESET	3
- #define MUSLI_BLK_SIZE 60
- void musliInit(uint8_t mode);
- void musliCmd(uint8_t cmd, uint8_t arg1, uint8_t arg2, uint8_t arg3);
- void musliSetMode(uint8_t pin, uint8_t dir);
- void musliWrite(uint8_t pin, uint8_t bit);
- uint8_t musliRead(uint8_t pin);
+#endif
+
+#ifdef BACKEND_LIBUSB
+
+ #include <libusb-1.0/libusb.h>
+ #include <fcntl.h>
+ #define MUSLI_PKT_SIZE 64
+ #define MUSLI_TXQ_PKTS 64
+ #define MUSLI_MAX_DEPTH 32
+ #define MUSLI_HOTPLUG_MAX 8
+ #define MUSLI_CACHE_FILE "ldprog-usb"	// serial -> port path, in ~/.cache
+ #if defined(__linux__) && defined(LIBUSB_API_VERSION) && \
+	(LIBUSB_API_VERSION >= 0x01000107)
+  #define MUSLI_SYS_OPEN	// libusb_wrap_sys_device()
+ #endif
+ int musliUsbOpen(void);
+ void musliUsbClose(void);
+ libusb_device_handle *musliOpen(int bus, int addr, const char *path,
+	const char *serial, int wait);
+ libusb_device_handle *musliOpenSys(int bus, int addr, const char *path);
+ libusb_device_handle *musliWaitDevice(int bus, int addr, const char *path,
+	const char *serial, int wait);
+ int musliMatch(libusb_device *dev, int bus, int addr, const char *path,
+	const char *serial, libusb_device_handle **dh);
+ int musliIsVendor(libusb_device *dev);
+ int musliSerialIs(libusb_device_handle *dh, const char *serial);
+ void musliPortPath(libusb_device *dev, char *path, int len);
+ void musliList(void);
+ int musliArrived(libusb_context *ctx, libusb_device *dev,
+	libusb_hotplug_event event, void *user_data);
+ void musliUsbCmd(uint8_t cmd, uint8_t arg1, uint8_t arg2, uint8_t arg3,
+	const uint8_t *data, uint8_t dlen);
+ int musliUsbQuery(uint8_t cmd, uint8_t arg1, uint8_t arg2, uint8_t arg3,
+	const uint8_t *data, uint8_t dlen, uint8_t *reply, int len, int timeout);
+ void musliUsbOut(uint8_t cmd, const uint8_t *buf, uint32_t len);
+ void musliUsbSpiWrite(const uint8_t *buf, uint32_t len);
+ uint8_t musliUsbRead(uint8_t pin);
+ void musliBegin(void);
+ void musliEnd(void);
+ uint8_t *musliPkt(uint8_t cmd, uint8_t arg1, uint8_t arg2, uint8_t arg3);
+ uint8_t *musliPktData(uint8_t cmd, uint8_t arg1, uint8_t arg2, uint8_t arg3,
+	const uint8_t *data, uint8_t dlen);
+ void musliSpiIn(uint8_t *buf, uint32_t len);
+ void musliFlush(void);
+ void musliSync(void);
+ void musliStart(void);
+ void musliStop(void);
+ void musliXferDone(struct libusb_transfer *xfer);
+ void *musliEvents(void *arg);
+ extern struct transport transport_libusb;
  struct libusb_device_handle *usb_dh = NULL;
+ libusb_device *musli_arrived[MUSLI_HOTPLUG_MAX];
+ int musli_arrived_cnt = 0;
+ struct musli_slot {
+	struct libusb_transfer *xfer;
+	uint8_t *buf;		// MUSLI_TXQ_PKTS * MUSLI_PKT_SIZE, in musli_mem
+	int busy;
+ };
+ struct musli_slot musli_slots[MUSLI_MAX_DEPTH];
+ struct musli_rx {
+	struct libusb_transfer *xfer;
+	uint8_t *buf;		// MUSLI_PKT_SIZE, in musli_mem
+	int busy;
+ };
+ uint8_t *musli_mem = NULL;
+ size_t musli_mem_len = 0;
+ int musli_mem_dev = 0;
+ struct musli_rx musli_rx_slots[MUSLI_MAX_DEPTH];
+ int musli_slot_cur = 0;
+ int musli_xfer_status = 0;
+ int musli_ev_run = 0;
+ pthread_t musli_ev_thread;
+ pthread_mutex_t musli_lock = PTHREAD_MUTEX_INITIALIZER;
+ pthread_cond_t musli_cond = PTHREAD_COND_INITIALIZER;
+ uint8_t *musli_txq = NULL;
+ int musli_txq_pkts = 0;
+ int musli_txq_open = 0;
 
-#elif BACKEND_HIDAPI
+#endif
+
+#ifdef BACKEND_HIDAPI
 
  #include "hidapi.h"
- #define GPIO_WRITE musliWrite
- #define GPIO_READ musliRead
- #define GPIO_SET_MODE musliSetMode
- #define PI_INPUT 0
- #define PI_OUTPUT 1
- #define USB_MFG_ID 0x2e8a
- #define USB_DEV_ID 0x1025
- #define CSPI_SS	4
- #define CSPI_SO	7
- #define CSPI_SI	6
- #define CSPI_SCK	5
- #define CDONE		2
- #define CRESET	3
- #define MUSLI_BLK_SIZE 128
+ #define HID_BLK_SIZE 128
+ #define HID_BLK_MAX 249			// 255 - [0xaa status cmd a1 a2 a3]
+ #define HID_REPLY_MAX 253		// 255 - [0xaa status]
+ #define HID_TIMEOUT 5000		// ms, for commands without their own
+ #define HID_SPIN_US 200			// poll back to back this long,
+ #define HID_SLEEP_MIN_US 20		// then sleep between polls, doubling
+ #define HID_SLEEP_MAX_US 1000	// up to this
+ #define HID_STREAM_DEPTH 8		// reads in flight in stream mode
+ #define HID_REPLY 0x01			// status byte of a request: send a reply
+ #define HID_STREAM (musli_caps.cmds & MUSLI_CAP_HID_STREAM)
+ #define HID_SYNC (musli_caps.cmds & MUSLI_CAP_HID_SYNC)
+ #define HID_SYNC_MAX 64			// unacked commands before a barrier
+ #define HID_CACHE_FILE "ldprog-hid"	// serial -> hidraw path, in ~/.cache
+ int hidapi_write(uint8_t *buf, int reply);
+ int hidapi_read(uint8_t *buf, int timeout);
+ int hidapi_wait(uint8_t *buf, int timeout);
+ void hidapi_stat(uint8_t cmd, uint64_t elapsed, uint32_t polls);
+ int hidapi_sync(void);
+ int hidapi_send_get_timeout(uint8_t *buf, int timeout);
+ uint8_t hid_sent[128][4];		// cmd and args, by sequence number
+ uint8_t hid_seq = 0;
+ int hid_unacked = 0;
+ struct hid_stat {
+	uint32_t count;
+	uint32_t polls;
+	uint64_t total_us;
+	uint32_t max_us;
+ };
+ struct hid_stat hid_stats[256];	// by command
+ uint64_t hid_open_us = 0;
+ void hidapi_show_stats(void);
+ int musliHidOpen(void);
+ void musliHidClose(void);
+ void musliHidList(void);
+ hid_device *hidapi_open_serial(const char *serial);
+ int hidapi_serial_is(const wchar_t *w, const char *serial);
+ void musliHidCmd(uint8_t cmd, uint8_t arg1, uint8_t arg2, uint8_t arg3,
+	const uint8_t *data, uint8_t dlen);
+ int musliHidQuery(uint8_t cmd, uint8_t arg1, uint8_t arg2, uint8_t arg3,
+	const uint8_t *data, uint8_t dlen, uint8_t *reply, int len, int timeout);
+ void musliHidOut(uint8_t cmd, const uint8_t *buf, uint32_t len);
+ void musliHidBegin(void);
+ void musliHidEnd(void);
+ void hidapi_flush(void);
+ uint8_t hid_txq[255];			// data report being filled, see musliHidOut()
+ int hid_txq_open = 0;
+ void musliHidSpiWrite(const uint8_t *buf, uint32_t len);
+ void musliHidSpiIn(uint8_t *buf, uint32_t len);
+ uint8_t musliHidRead(uint8_t pin);
+ hid_device *usb_hd = NULL;
+ extern struct transport transport_hidapi;
+
+#endif
+
+// preferred first
+struct transport *transports[] = {
+#ifdef BACKEND_LIBUSB
+	&transport_libusb,
+#endif
+#ifdef BACKEND_HIDAPI
+	&transport_hidapi,
+#endif
+#ifdef BACKEND_PIGPIO
+	&transport_pigpio,
+#endif
+#ifdef BACKEND_SPIDEV
+	&transport_spidev,
+#endif
+	NULL
+};
+
+int transport_open(const char *name);
+
+// musli protocol, on top of the transport's musli_* operations
+
+ struct musli_caps {
+	uint8_t version;		// 0 = firmware without capability support
+	uint8_t max_payload;	// SPI bytes per command
+	uint8_t max_reply;		// reply bytes per command
+	uint8_t spi_clocks;	// mask of MUSLI_SPI_CLKS
+	uint32_t cmds;			// mask of MUSLI_CAP_*
+ };
+ struct musli_caps musli_caps = { 0, 0, 0, 0, 0 };
+ int musli_blk_size = 0;
+ int musli_reply_size = 0;
+ int musli_spi_clk = -1;
  void musliInit(uint8_t mode);
  void musliCmd(uint8_t cmd, uint8_t arg1, uint8_t arg2, uint8_t arg3);
+ void musliCmdData(uint8_t cmd, uint8_t arg1, uint8_t arg2, uint8_t arg3,
+	const uint8_t *data, uint8_t dlen);
  void musliSetMode(uint8_t pin, uint8_t dir);
- void musliWrite(uint8_t pin, uint8_t bit);
- uint8_t musliRead(uint8_t pin);
- struct hid_device *usb_hd = NULL;
-
-#endif
+ void musliWrite(uint8_t pin, uint8_t val);
+ int musliQuery(uint8_t cmd, uint8_t arg1, uint8_t arg2, uint8_t arg3,
+	const uint8_t *data, uint8_t dlen, uint8_t *reply, int len, int timeout);
+ void musliOut(uint8_t cmd, const uint8_t *buf, uint32_t len);
+ void musliProbe(void);
+ void musliSetClock(void);
+ int musliProgramSector(uint32_t addr, const uint8_t *data);
+ int musliFlashCrc(uint32_t addr, uint32_t len, uint32_t *crc);
+ int musliFlashWait(uint8_t mask, uint16_t timeout, uint32_t *elapsed);
+ int musliSpiXfer(const uint8_t *wbuf, uint8_t wlen, uint8_t *rbuf,
+	uint8_t rlen, uint8_t flags);
 
 // --
 // CONFIGURATION:
 // --
 #define RST_DELAY 250000
 #define QSPI_MODE false
+#define READ_BLK_SIZE 4096	// bytes per flash read command in dump/verify
+#define CRC_BLK_SIZE 65536		// bytes per device-side checksum in verify
+#define SPI_MAX_KHZ 24000		// fastest SPI clock picked from the firmware's list
+#define SRAM_BLK_SIZE 16384	// bytes per spi_write in an SRAM load (progress)
+#define PROGRESS_TTY_MS 100	// progress line redraw interval on a terminal,
+#define PROGRESS_LOG_MS 2000	// and when stdout is a file or pipe
+#define RT_PRIORITY 50			// SCHED_FIFO priority with -R
+#define RT_STACK_PREFAULT (256 * 1024)
+#define SERIAL_CACHE_MAX 32	// devices remembered per cache file
+#define FLASH_WAIT_MAX_MS 200000	// longest a flash may stay busy (chip erase)
 
 #define DELAY() usleep(1000);
 
+#define PIN(n) (1ULL << (n))
+#define GPIO_MASK_PINS 64		// pins a gpio_set/gpio_get mask holds
+
 void fpga_reset(void);
+void gpio_set(uint64_t dir_mask, uint64_t dir, uint64_t out_mask, uint64_t out);
+uint64_t gpio_get(uint64_t mask);
 void spi_release(void);
+void spi_begin(void);
+void spi_end(void);
 void spi_cmd(uint8_t cmd);
 void spi_addr(uint32_t addr);
 void spi_write(void *buf, uint32_t len);
 void spi_read(void *buf, uint32_t len);
 uint8_t spi_read_byte(void);
+void spi_xfer(const uint8_t *wbuf, uint32_t wlen, uint8_t *rbuf, uint32_t rlen);
 uint8_t flash_status(void);
-void flash_wait(void);
+void flash_read(uint32_t addr, void *buf, uint32_t len);
+int flash_wait(void);
 void flash_write_enable(void);
+uint32_t crc32(const uint8_t *buf, uint32_t len);
+uint64_t time_us(void);
+uint64_t time_ns(void);
+void realtime_start(int cpu);
+void progress_start(const char *what, uint64_t total);
+void progress_update(uint64_t done);
+void progress_break(void);
+void progress_end(uint64_t done);
+int flash_check(uint32_t addr, const void *buf, uint32_t len);
+int pins_parse(char *map);
+int serial_cache_path(const char *name, char *path, size_t len);
+int serial_cache_get(const char *name, const char *serial, char *path,
+	size_t len);
+void serial_cache_put(const char *name, const char *serial, const char *path);
+int serial_cache_mkdir(const char *file);
 
 // --
 
@@ -129,7 +508,25 @@ void show_usage(char **argv) {
       " -i\teis mode\n" \
       " -w\twerkzeug mode (only for flashing MMODs via Werkzeugs PMOD)\n" \
       " -I\tinvert ss (access device #2 on MMOD-D modules)\n" \
+      " -p\tpin numbers, overriding the board's (ss=<n>,so=<n>,si=<n>,sck=<n>,\n" \
+      "\tcdone=<n>,creset=<n>; for spidev, line offsets on the gpio chip)\n" \
       " -n\tdon't retry block if flashing fails\n" \
+      " -q\tnumber of usb transfers kept in flight (default: 4)\n" \
+      " -F\tpigpio/spidev hardware spi clock in kHz (0: don't use it,\n" \
+      "\tdefault: 8000)\n" \
+      " -x\tpigpio: without hardware spi, clock long writes (sram loads) out as\n" \
+      "\tdma waveforms at a fixed rate (500 kHz, or the -F clock if lower)\n" \
+      " -T\tuse this transport: libusb, hidapi, pigpio or spidev (default: the\n" \
+      "\tfirst one built in that finds a device, in that order)\n" \
+      " -l\tlist usb devices and exit\n" \
+      " -L\tprint interface latency statistics at exit\n" \
+      " -R\trealtime: SCHED_FIFO, memory locked, pinned to this cpu (-1: any)\n" \
+      " -S\tuse the usb device with this serial number\n" \
+      " -P\tuse the usb device at this port path (<bus>-<port>[.<port>...], see -l)\n" \
+      "\tor, for hidapi, at this hidraw path (/dev/hidrawN)\n" \
+      " -G\tspidev: gpio chip the pins are lines of (default: /dev/gpiochip0)\n" \
+      " -Y\tspidev: spi device for the data (default: /dev/spidev0.0)\n" \
+      " -W\twait up to <n> seconds for the usb device to be plugged in (0: forever)\n" \
 		"\nWARNING: writing to flash erases 4K blocks starting at offset\n",
       argv[0]);
 }
@@ -159,13 +556,31 @@ int spi_swap = 0;
 int spi_ss_active = 0;
 int spi_ss_inactive = 1;
 int retry_mode = 1;
-
-uint8_t cspi_ss = CSPI_SS;
-uint8_t cspi_si = CSPI_SI;
-uint8_t cspi_so = CSPI_SO;
-uint8_t cspi_sck = CSPI_SCK;
-uint8_t cdone = CDONE;
-uint8_t creset = CRESET;
+int usb_queue_depth = 4;
+int spi_khz = -1;
+int spi_wave = 0;
+int show_stats = 0;
+int rt_cpu = -2;		// -R; -2 = off
+int usb_list = 0;
+int usb_wait = -1;
+char *usb_serial = NULL;
+char *usb_path = NULL;
+int usb_bus = -1;
+int usb_addr = -1;
+char *transport_name = NULL;
+char *gpio_chip_path = NULL;
+char *spidev_path = NULL;
+char *pin_map = NULL;
+
+// pins not set by a board option get the transport's default wiring
+#define PIN_UNSET 0xff
+
+uint8_t cspi_ss = PIN_UNSET;
+uint8_t cspi_si = PIN_UNSET;
+uint8_t cspi_so = PIN_UNSET;
+uint8_t cspi_sck = PIN_UNSET;
+uint8_t cdone = PIN_UNSET;
+uint8_t creset = PIN_UNSET;
 
 int main(int argc, char *argv[]) {
 
@@ -179,7 +594,7 @@ int main(int argc, char *argv[]) {
 	int gpionum;
 	int gpioval = -1;
 
-   while ((opt = getopt(argc, argv, "hsfrdvmetagbcDwkKinI")) != -1) {
+   while ((opt = getopt(argc, argv, "hsfrdvmetagbcDwkKinIxq:lLS:P:W:T:F:R:G:Y:p:")) != -1) {
       switch (opt) {
          case 'h': show_usage(argv); return(0); break;
          case 's': mem_type = MEM_TYPE_SRAM; mode = MODE_WRITE; break;
@@ -199,14 +614,24 @@ int main(int argc, char *argv[]) {
          case 'K': options |= OPTION_KOLIBRI; break;
          case 'w': options |= OPTION_WERKZEUG; break;
          case 'n': retry_mode = 0; break;
+         case 'q': usb_queue_depth = atoi(optarg); break;
+         case 'F': spi_khz = atoi(optarg); break;
+         case 'x': spi_wave = 1; break;
+         case 'l': usb_list = 1; break;
+         case 'L': show_stats = 1; break;
+         case 'R': rt_cpu = atoi(optarg); break;
+         case 'S': usb_serial = optarg; break;
+         case 'P': usb_path = optarg; break;
+         case 'W': usb_wait = atoi(optarg); break;
+         case 'T': transport_name = optarg; break;
+         case 'G': gpio_chip_path = optarg; break;
+         case 'Y': spidev_path = optarg; break;
+         case 'p': pin_map = optarg; break;
          case 'D': debug = 1; break;
          case 'I': spi_ss_active = 1; spi_ss_inactive = 0; break;
       }
    }
 
-	int usb_bus = -1;
-	int usb_addr = -1;
-
 	int musli_cmd = 0;
 	int musli_arg1 = 0;
 	int musli_arg2 = 0;
@@ -264,6 +689,11 @@ int main(int argc, char *argv[]) {
 		cspi_sck = 13;	// PMOD_A4 /  MMOD PIN 4 (SCK)
 	}
 
+	if (pin_map != NULL && pins_parse(pin_map)) {
+		show_usage(argv);
+		return(1);
+	}
+
    if ((mode == MODE_READ || mode == MODE_WRITE) && optind >= argc) {
       show_usage(argv);
       return(1);
@@ -302,72 +732,23 @@ int main(int argc, char *argv[]) {
 
 	}
 
-#ifdef BACKEND_PIGPIO
-	if (gpioInitialise() < 0) {
-		fprintf(stderr, "gpio init error\n");
-		exit(1);
-	}
-#elif BACKEND_LIBUSB
-	if (libusb_init(NULL) < 0) {
-		fprintf(stderr, "usb init error\n");
-		exit(1);
-	}
-
-	libusb_device **list = NULL;
-	ssize_t count = 0;
-
-	count = libusb_get_device_list(NULL, &list);
-
-	printf("devices found: \n");
-
-	for (size_t idx = 0; idx < count; ++idx) {
-
-		libusb_device *dev = list[idx];
-		struct libusb_device_descriptor desc = {0};
-
-		int rc = libusb_get_device_descriptor(dev, &desc);
-		if (rc != 0) continue;
-
-		int bus = libusb_get_bus_number(dev);
-		int addr = libusb_get_device_address(dev);
-
-		if (desc.idVendor == USB_MFG_ID && desc.idProduct == USB_DEV_ID) {
-
-			printf(" vendor %04x id %04x serial %i bus %i addr %i\n",
-				desc.idVendor, desc.idProduct, desc.iSerialNumber, bus, addr);
-
-			if ((usb_bus == -1 && usb_addr == -1) ||
-					(usb_bus == bus && usb_addr == addr)) {
-
-				if (usb_dh == NULL) {
-					printf("using bus %i addr %i\n", bus, addr);
-					libusb_open(dev, &usb_dh);
-				}
-
-			}
+	if (usb_list) {
+		for (int t = 0; transports[t] != NULL; t++) {
+			if (transports[t]->list != NULL && (transport_name == NULL ||
+					!strcmp(transport_name, transports[t]->name)))
+				transports[t]->list();
 		}
-
-	}
-
-	if (count == 0) printf("none.\n");
-
-	libusb_free_device_list(list, count);
-
-	if (!usb_dh) {
-		fprintf(stderr, "usb device error\n");
-		exit(1);
+		exit(0);
 	}
 
-#elif BACKEND_HIDAPI
-
-	usb_hd = (struct hid_device *)hid_open( USB_MFG_ID, USB_DEV_ID, L"0000");
-	if (!usb_hd) {
-		fprintf( stderr, "Error: Failed to open device.\n" );
+	if (transport_open(transport_name)) {
+		if (transport_name != NULL)
+			fprintf(stderr, "%s: no device found\n", transport_name);
+		else
+			fprintf(stderr, "no interface device found\n");
 		exit(1);
 	}
 
-#endif
-
 	if (mode == MODE_CMD) {
 
 		if (debug)
@@ -375,6 +756,7 @@ int main(int argc, char *argv[]) {
 				musli_arg1, musli_arg2, musli_arg3);
 
 		musliCmd(musli_cmd, musli_arg1, musli_arg2, musli_arg3);
+		tp->close();
 		exit(0);
 
 	} else if (mode == MODE_GPIO) {
@@ -389,28 +771,31 @@ int main(int argc, char *argv[]) {
 			printf("read gpio #%i val: 0x%.2X\n", gpionum, gpioval);
 		}
 
+		tp->close();
 		exit(0);
 
 	}
 
-	if (mem_type == MEM_TYPE_FLASH) {
-		musliInit(0);
-		musliInit(2);
-		// args: sck, mosi, mosi
-		musliCmd(MUSLI_CMD_CFG_PIO_SPI, cspi_sck, cspi_so, cspi_si);
-	} else {
-		musliInit(0);
+	if (tp->caps.compound) {
+		if (mem_type == MEM_TYPE_FLASH) {
+			musliInit(0);
+			musliInit(2);
+			// args: sck, mosi, mosi
+			musliCmd(MUSLI_CMD_CFG_PIO_SPI, cspi_sck, cspi_so, cspi_si);
+		} else {
+			musliInit(0);
+		}
+		musliSetClock();
 	}
 
-	GPIO_SET_MODE(cspi_ss, PI_OUTPUT);
-	GPIO_SET_MODE(creset, PI_OUTPUT);
-	GPIO_SET_MODE(cdone, PI_INPUT);
+	gpio_set(PIN(cspi_ss) | PIN(creset) | PIN(cdone), PIN(cspi_ss) | PIN(creset),
+		0, 0);
 
 	if (mem_type == MEM_TYPE_TEST) {
       GPIO_WRITE(creset, 0);
 		printf("test mode; holding in reset\n");
 		while(1) {
-			printf("cdone: %i\n", GPIO_READ(cdone));
+			printf("cdone: %i\n", gpio_get(PIN(cdone)) ? 1 : 0);
 			usleep(500000);
 		};
 	}
@@ -442,21 +827,21 @@ int main(int argc, char *argv[]) {
 
 	}
 
+	if (rt_cpu != -2)
+		realtime_start(rt_cpu);
+
 	if (mem_type == MEM_TYPE_SRAM) {
 
 		printf("writing to sram ...\n");
 
 		spi_swap = 1;
 
-		GPIO_SET_MODE(cspi_si, PI_OUTPUT);
-		GPIO_SET_MODE(cspi_so, PI_INPUT);
-
 		if ((options & OPTION_MANUAL_RESET) == OPTION_MANUAL_RESET)
 			printf("press reset button now\n");
 
 		// reset fpga into SPI slave configuration mode
-		GPIO_WRITE(cspi_ss, 0);
-		GPIO_WRITE(creset, 0);
+		gpio_set(PIN(cspi_si) | PIN(cspi_so), PIN(cspi_si),
+			PIN(cspi_ss) | PIN(creset), 0);
 		usleep(RST_DELAY);
 		printf("cdone: %i\n", GPIO_READ(cdone));
 
@@ -471,12 +856,17 @@ int main(int argc, char *argv[]) {
 
 		printf("cdone: %i\n", GPIO_READ(cdone));
 
-		GPIO_WRITE(cspi_sck, 1);
-		GPIO_WRITE(cspi_ss, 1);
+		gpio_set(0, 0, PIN(cspi_sck) | PIN(cspi_ss), PIN(cspi_sck) | PIN(cspi_ss));
 		spi_write(NULL, 1);
 		GPIO_WRITE(cspi_ss, 0);
 
-		spi_write(buf, len);
+		progress_start("loading", len);
+		for (uint32_t i = 0, n; i < len; i += n) {
+			n = len - i < SRAM_BLK_SIZE ? len - i : SRAM_BLK_SIZE;
+			spi_write(buf + i, n);
+			progress_update(i + n);
+		}
+		progress_end(len);
 
 		GPIO_WRITE(cspi_ss, 1);
 		spi_write(NULL, 14);
@@ -488,36 +878,32 @@ int main(int argc, char *argv[]) {
 
 		spi_swap = 0;
 
-#ifdef BACKEND_PIGPIO
-		GPIO_SET_MODE(cspi_si, PI_INPUT);
-		GPIO_SET_MODE(cspi_so, PI_OUTPUT);
-#endif
+		if (!tp->caps.compound) {
+			// bit-banged on the host
+			GPIO_SET_MODE(cspi_si, PI_INPUT);
+			GPIO_SET_MODE(cspi_so, PI_OUTPUT);
+		}
 
 		char fbuf[256];
-		char vbuf[256];
 		int i = 0;
 		int flen = len;
 
 		// hold fpga in reset mode
-		GPIO_WRITE(creset, 0);
-		DELAY();
+		gpio_set(0, 0, PIN(creset) | PIN(cspi_ss),
+			spi_ss_inactive ? PIN(cspi_ss) : 0);
 
-#ifdef BACKEND_PIGPIO
-		GPIO_WRITE(cspi_sck, 0);
-#endif
+		if (!tp->caps.compound)
+			GPIO_WRITE(cspi_sck, 0);
 
-		GPIO_WRITE(cspi_ss, spi_ss_inactive);
 		DELAY();
 
 		printf(" flash status: 0x%.2x\n", flash_status());
 
 		// exit power down mode
 		printf("exiting power down mode\n");
-		GPIO_WRITE(cspi_ss, spi_ss_active);
-		DELAY();
+		spi_begin();
 		spi_cmd(0xab);
-		DELAY();
-		GPIO_WRITE(cspi_ss, spi_ss_inactive);
+		spi_end();
 		usleep(5000);
 		printf(" flash status: 0x%.2x\n", flash_status());
 
@@ -526,14 +912,63 @@ int main(int argc, char *argv[]) {
 
 		// global block unlock
 		printf("global block unlock ...\n");
-		GPIO_WRITE(cspi_ss, spi_ss_active);
-		DELAY();
+		spi_begin();
 		spi_cmd(0x98);
-		DELAY();
-		GPIO_WRITE(cspi_ss, spi_ss_inactive);
+		spi_end();
 		usleep(5000);
 		printf(" flash status: 0x%.2x\n", flash_status());
 
+		// let the interface device erase, program and check whole sectors
+		if ((musli_caps.cmds & MUSLI_CAP_PROG_SECTOR) &&
+				!(flash_offset % MUSLI_SECTOR_SIZE)) {
+
+			uint8_t sbuf[MUSLI_SECTOR_SIZE];
+
+			printf("writing %i bytes @ %.6X (device-side) ...\n", len, flash_offset);
+			progress_start("writing", len);
+
+			while (i < len) {
+
+				int maxtries = 16;
+
+				if (len - i >= MUSLI_SECTOR_SIZE)
+					flen = MUSLI_SECTOR_SIZE;
+				else
+					flen = len - i;
+
+				// pad the last sector; programming 0xff leaves it erased
+				memset(sbuf, 0xff, MUSLI_SECTOR_SIZE);
+				memcpy(sbuf, buf + i, flen);
+
+				sector_tryagain:
+
+				if (musliProgramSector(flash_offset + i, sbuf)) {
+					progress_break();
+					printf(" programming sector @ %.6x ... ", flash_offset + i);
+					if (retry_mode) {
+						printf("failed; retrying\n");
+						--maxtries;
+						if (maxtries) {
+							goto sector_tryagain;
+						} else {
+							printf("failed to write; aborting\n");
+							exit(1);
+						}
+					} else {
+						printf("failed\n");
+					}
+				}
+
+				i += flen;
+				progress_update(i);
+
+			}
+
+			progress_end(len);
+			goto write_done;
+
+		}
+
 		int blk_size = 4096;
 		int blks = (len / blk_size);
 
@@ -543,24 +978,33 @@ int main(int argc, char *argv[]) {
 		printf("erasing flash from %.6x to %.6x ...\n",
 			flash_offset, flash_offset + blks*blk_size);
 
+		progress_start("erasing", (uint64_t)(blks + 2) * blk_size);
+
 		for (int blk = 0; blk <= blks + 1; blk++) {
 
-			printf(" erasing 4K flash at %.6x ...\n",
-				flash_offset + (blk * blk_size));
+			if (debug)
+				printf(" erasing 4K flash at %.6x ...\n",
+					flash_offset + (blk * blk_size));
 			flash_write_enable();
 
-			GPIO_WRITE(cspi_ss, spi_ss_active);
-			DELAY();
+			spi_begin();
 			spi_cmd(0x20);
 			spi_addr(flash_offset + (blk * blk_size));
-			DELAY();
-			GPIO_WRITE(cspi_ss, spi_ss_inactive);
+			spi_end();
+
+			if (flash_wait()) {
+				printf("failed to erase; aborting\n");
+				exit(1);
+			}
 
-			flash_wait();
+			progress_update((uint64_t)(blk + 1) * blk_size);
 
 		}
 
+		progress_end((uint64_t)(blks + 2) * blk_size);
+
 		printf("writing %i bytes @ %.6X ...\n", len, flash_offset);
+		progress_start("writing", len);
 
 		while (i < len) {
 
@@ -572,31 +1016,23 @@ int main(int argc, char *argv[]) {
 
 			tryagain:
 
-			printf(" writing %i bytes @ %.6x ... ", flen, flash_offset + i);
-
 			flash_write_enable();
 
-			printf("[status: 0x%.2x] ", flash_status());
+			if (debug)
+				printf(" writing %i bytes @ %.6x [status: 0x%.2x]\n", flen,
+					flash_offset + i, flash_status());
 
 			// program
-			GPIO_WRITE(cspi_ss, spi_ss_active);
+			spi_begin();
 			spi_cmd(0x02);
 			spi_addr(flash_offset + i);
 			spi_write(fbuf, flen);
-			GPIO_WRITE(cspi_ss, spi_ss_inactive);
-
-			flash_wait();
+			spi_end();
 
-			// read back
-			GPIO_WRITE(cspi_ss, spi_ss_active);
-			spi_cmd(0x03);
-			spi_addr(flash_offset + i);
-			spi_read(vbuf, flen);
-			GPIO_WRITE(cspi_ss, spi_ss_inactive);
-
-			if (!memcmp(fbuf, vbuf, flen)) {
-				printf("ok\n");
-			} else {
+			// check
+			if (flash_wait() || flash_check(flash_offset + i, fbuf, flen)) {
+				progress_break();
+				printf(" writing %i bytes @ %.6x ... ", flen, flash_offset + i);
 				if (retry_mode) {
 					printf("failed; retrying\n");
 					--maxtries;
@@ -612,8 +1048,13 @@ int main(int argc, char *argv[]) {
 			}
 
 			i += flen;
+			progress_update(i);
 
 		}
+
+		progress_end(len);
+
+		write_done:
 		printf("done writing.\n");
 
 		printf(" flash status: 0x%.2x\n", flash_status());
@@ -622,164 +1063,185 @@ int main(int argc, char *argv[]) {
 
 		spi_swap = 0;
 
-#ifdef BACKEND_PIGPIO
-		GPIO_SET_MODE(cspi_si, PI_INPUT);
-		GPIO_SET_MODE(cspi_so, PI_OUTPUT);
-#endif
+		if (!tp->caps.compound) {
+			// bit-banged on the host
+			GPIO_SET_MODE(cspi_si, PI_INPUT);
+			GPIO_SET_MODE(cspi_so, PI_OUTPUT);
+		}
 
 		printf("reading flash to %s ...\n", argv[optind]);
 
-		char fbuf[256];
+		char fbuf[READ_BLK_SIZE];
+		uint32_t rlen;
 		fp = fopen(argv[optind], "w");
 
 		// hold fpga in reset mode
-		GPIO_WRITE(creset, 0);
-		GPIO_WRITE(cspi_ss, spi_ss_inactive);
+		gpio_set(0, 0, PIN(creset) | PIN(cspi_ss),
+			spi_ss_inactive ? PIN(cspi_ss) : 0);
 
-#ifdef BACKEND_PIGPIO
-		GPIO_WRITE(cspi_sck, 1);
-#endif
+		if (!tp->caps.compound)
+			GPIO_WRITE(cspi_sck, 1);
 
 		// exit power down mode
 		printf("exiting power down mode\n");
-		GPIO_WRITE(cspi_ss, spi_ss_active);
-		DELAY();
+		spi_begin();
 		spi_cmd(0xab);
-		DELAY();
-		GPIO_WRITE(cspi_ss, spi_ss_inactive);
+		spi_end();
 		usleep(5000);
 		printf(" flash status: 0x%.2x\n", flash_status());
 
 		// read JEDEC ID
+		uint8_t idcmd = 0x9f;
 		uint8_t idbuf[5];
 		printf("flash id: ");
-		GPIO_WRITE(cspi_ss, spi_ss_active);
-		spi_cmd(0x9f);
-		spi_read(idbuf, 5);
+		spi_xfer(&idcmd, 1, idbuf, 5);
 		for (int i = 0; i < 5; i++)
 			printf("%.2x ", idbuf[i]);
-		GPIO_WRITE(cspi_ss, spi_ss_inactive);
 		printf("\n");
 
 		printf("reading %i bytes @ addr 0x%x\n", flash_size, flash_offset);
+		progress_start("reading", flash_size);
 
-		for (int i = 0; i < flash_size / 256; i++) {
+		for (uint32_t i = 0; i < flash_size; i += rlen) {
 
-			printf("reading from 0x%.6x\n", flash_offset + (i * 256));
+			if (flash_size - i >= READ_BLK_SIZE)
+				rlen = READ_BLK_SIZE;
+			else
+				rlen = flash_size - i;
 
 			// read data from flash
-			GPIO_WRITE(cspi_ss, spi_ss_active);
-			spi_cmd(0x03);
-			spi_addr(flash_offset + (i * 256));
-			spi_read(fbuf, 256);
-			GPIO_WRITE(cspi_ss, spi_ss_inactive);
+			flash_read(flash_offset + i, fbuf, rlen);
 
-			fwrite(fbuf, 256, 1, fp);
+			fwrite(fbuf, rlen, 1, fp);
+
+			progress_update(i + rlen);
 
 		}
 
+		progress_end(flash_size);
+
 		fclose(fp);
 
 	} else if (mem_type == MEM_TYPE_FLASH && mode == MODE_VERIFY) {
 
 		spi_swap = 0;
-		char fbuf[256];
+		char fbuf[READ_BLK_SIZE];
 		int i = 0;
 		int flen;
+		int rlen;
 		int mismatches = 0;
+		int checked = 0;
 
-#ifdef BACKEND_PIGPIO
-		GPIO_SET_MODE(cspi_si, PI_INPUT);
-		GPIO_SET_MODE(cspi_so, PI_OUTPUT);
-#endif
+		if (!tp->caps.compound) {
+			// bit-banged on the host
+			GPIO_SET_MODE(cspi_si, PI_INPUT);
+			GPIO_SET_MODE(cspi_so, PI_OUTPUT);
+		}
 
 		printf("verifying flash ...\n");
 
 		// hold fpga in reset mode
-		GPIO_WRITE(creset, 0);
-		GPIO_WRITE(cspi_ss, spi_ss_inactive);
+		gpio_set(0, 0, PIN(creset) | PIN(cspi_ss),
+			spi_ss_inactive ? PIN(cspi_ss) : 0);
 
-#ifdef BACKEND_PIGPIO
-		GPIO_WRITE(cspi_sck, 1);
-#endif
+		if (!tp->caps.compound)
+			GPIO_WRITE(cspi_sck, 1);
 
 		// exit power down mode
 		printf("exiting power down mode\n");
-		GPIO_WRITE(cspi_ss, spi_ss_active);
-		DELAY();
+		spi_begin();
 		spi_cmd(0xab);
-		DELAY();
-		GPIO_WRITE(cspi_ss, spi_ss_inactive);
+		spi_end();
 		usleep(5000);
 		printf(" flash status: 0x%.2x\n", flash_status());
 
 		// read JEDEC ID
+		uint8_t idcmd = 0x9f;
+		uint8_t idbuf[5];
 		printf("flash id: ");
-		GPIO_WRITE(cspi_ss, spi_ss_active);
-		spi_cmd(0x9f);
+		spi_xfer(&idcmd, 1, idbuf, 5);
 		for (int i = 0; i < 5; i++)
-			printf("%.2x ", spi_read_byte());
-		GPIO_WRITE(cspi_ss, spi_ss_inactive);
+			printf("%.2x ", idbuf[i]);
 		printf("\n");
 
 		printf("verifying %i bytes @ addr 0x%x\n", len, flash_offset);
+		progress_start("verifying", len);
 
 		while (i < len) {
 
-			if (len - i >= 256) flen = 256; else flen = len - i;
+			// with a device-side CRC only ranges that differ are read back
+			if ((musli_caps.cmds & MUSLI_CAP_CRC32) && i >= checked) {
+				uint32_t crc;
+				int clen;
+				if (len - i >= CRC_BLK_SIZE) clen = CRC_BLK_SIZE; else clen = len - i;
+				if (!musliFlashCrc(flash_offset + i, clen, &crc) &&
+						crc == crc32((uint8_t *)buf + i, clen)) {
+					if (debug)
+						printf(" crc ok for %i bytes from 0x%.6x\n", clen, flash_offset + i);
+					i += clen;
+					progress_update(i);
+					continue;
+				}
+				checked = i + clen;
+			}
 
-			printf(" reading %i bytes from 0x%.6x\n", flen, flash_offset + i);
+			if (len - i >= READ_BLK_SIZE) rlen = READ_BLK_SIZE; else rlen = len - i;
+
+			if (debug)
+				printf(" reading %i bytes from 0x%.6x\n", rlen, flash_offset + i);
 
 			// read data from flash
-			GPIO_WRITE(cspi_ss, spi_ss_active);
-			spi_cmd(0x03);
-			spi_addr(flash_offset + i);
-			spi_read(fbuf, flen);
-			GPIO_WRITE(cspi_ss, spi_ss_inactive);
-
-
-			if (memcmp(fbuf, buf + i, flen)) {
-				printf(" *** mismatch @ 0x%.6x\n", i);
-				printf("   FILE: ");
-				for (int x = 0; x < 256; x++) printf("%02x ", (unsigned char)buf[x+i]);
-				printf("\n  FLASH: ");
-				for (int x = 0; x < 256; x++) printf("%02x ", (unsigned char)fbuf[x]);
-				printf("\n\n");
-				mismatches++;
+			flash_read(flash_offset + i, fbuf, rlen);
+
+			// compare in 256 byte blocks
+			for (int b = 0; b < rlen; b += 256) {
+
+				if (rlen - b >= 256) flen = 256; else flen = rlen - b;
+
+				if (memcmp(fbuf + b, buf + i + b, flen)) {
+					progress_break();
+					printf(" *** mismatch @ 0x%.6x\n", i + b);
+					printf("   FILE: ");
+					for (int x = 0; x < flen; x++)
+						printf("%02x ", (unsigned char)buf[i+b+x]);
+					printf("\n  FLASH: ");
+					for (int x = 0; x < flen; x++)
+						printf("%02x ", (unsigned char)fbuf[b+x]);
+					printf("\n\n");
+					mismatches++;
+				}
+
 			}
 
-			i += flen;
+			i += rlen;
+			progress_update(i);
 
 		}
 
+		progress_end(len);
+
 		printf("block mismatches: %i\n", mismatches);
 
 	} else if (mem_type == MEM_TYPE_FLASH && mode == MODE_ERASE) {
 
 		spi_swap = 0;
 
-		GPIO_SET_MODE(cspi_si, PI_INPUT);
-		GPIO_SET_MODE(cspi_so, PI_OUTPUT);
-
 		// hold fpga in reset mode
-		GPIO_WRITE(creset, 0);
-		DELAY();
+		gpio_set(PIN(cspi_si) | PIN(cspi_so), PIN(cspi_so),
+			PIN(creset) | PIN(cspi_ss), spi_ss_inactive ? PIN(cspi_ss) : 0);
+
+		if (!tp->caps.compound)
+			GPIO_WRITE(cspi_sck, 0);
 
-#ifdef BACKEND_PIGPIO
-		GPIO_WRITE(cspi_sck, 0);
-#endif
-		GPIO_WRITE(cspi_ss, spi_ss_inactive);
 		DELAY();
 
 		printf(" flash status: 0x%.2x\n", flash_status());
 
 		// exit power down mode
 		printf("exiting power down mode\n");
-		GPIO_WRITE(cspi_ss, spi_ss_active);
-		DELAY();
+		spi_begin();
 		spi_cmd(0xab);
-		DELAY();
-		GPIO_WRITE(cspi_ss, spi_ss_inactive);
+		spi_end();
 		usleep(5000);
 		printf(" flash status: 0x%.2x\n", flash_status());
 
@@ -788,11 +1250,9 @@ int main(int argc, char *argv[]) {
 
 		// global block unlock
 		printf("global block unlock ...\n");
-		GPIO_WRITE(cspi_ss, spi_ss_active);
-		DELAY();
+		spi_begin();
 		spi_cmd(0x98);
-		DELAY();
-		GPIO_WRITE(cspi_ss, spi_ss_inactive);
+		spi_end();
 		usleep(5000);
 		printf(" flash status: 0x%.2x\n", flash_status());
 
@@ -800,13 +1260,14 @@ int main(int argc, char *argv[]) {
 		printf(" erasing flash ...\n");
 		flash_write_enable();
 
-		GPIO_WRITE(cspi_ss, spi_ss_active);
-		DELAY();
+		spi_begin();
 		spi_cmd(0xc7);
-		DELAY();
-		GPIO_WRITE(cspi_ss, spi_ss_inactive);
+		spi_end();
 
-		flash_wait();
+		if (flash_wait()) {
+			printf("failed to erase; aborting\n");
+			exit(1);
+		}
 
 		printf("done erasing.\n");
 
@@ -820,16 +1281,13 @@ int main(int argc, char *argv[]) {
 	if ( ((options & OPTION_BONBON) == OPTION_BONBON) ||
 			((options & OPTION_KEKS) == OPTION_KEKS) ||
 			((options & OPTION_KOLIBRI) == OPTION_KOLIBRI) ) {
-#ifdef BACKEND_LIBUSB
-		musliInit(3);
-#endif
+		if (tp->caps.init_release)
+			musliInit(3);
 	} else {
 		spi_release();
 	}
 
-#ifdef BACKEND_LIBUSB
-	libusb_exit(NULL);
-#endif
+	tp->close();
 
 	return 0;
 
@@ -841,8 +1299,7 @@ void fpga_reset(void) {
 
 	// release the SPI pins
 	spi_release();
-	GPIO_SET_MODE(creset, PI_OUTPUT);
-	GPIO_SET_MODE(cdone, PI_INPUT);
+	gpio_set(PIN(creset) | PIN(cdone), PIN(creset), 0, 0);
 
 	printf("cdone: %i\n", GPIO_READ(cdone));
 
@@ -859,400 +1316,565 @@ void fpga_reset(void) {
 };
 
 void spi_release(void) {
-#ifdef BACKEND_LIBUSB
-	musliInit(1);
-#endif
-	GPIO_SET_MODE(cspi_sck, PI_INPUT);
-	GPIO_SET_MODE(cspi_so, PI_INPUT);
-	GPIO_SET_MODE(cspi_si, PI_INPUT);
-	GPIO_SET_MODE(cspi_ss, PI_INPUT);
+	if (tp->caps.init_release)
+		musliInit(1);
+	gpio_set(PIN(cspi_sck) | PIN(cspi_so) | PIN(cspi_si) | PIN(cspi_ss), 0, 0, 0);
 }
 
-void spi_cmd(uint8_t cmd) {
-	if (debug)
-  		printf(" spi_cmd [%.2x]\n", cmd);
-#ifdef BACKEND_LIBUSB
-  	int actual;
-	uint8_t lbuf[64];
-	bzero(lbuf, 64);
-	lbuf[0] = MUSLI_CMD_SPI_WRITE;
-	lbuf[1] = 1;
-	lbuf[4] = cmd;
-  	libusb_bulk_transfer(usb_dh, (1 | LIBUSB_ENDPOINT_OUT), lbuf, 64,
-		&actual, 0);
-#elif BACKEND_HIDAPI
-	uint8_t lbuf[255];
-	bzero(lbuf, 255);
-	lbuf[2] = MUSLI_CMD_SPI_WRITE;
-	lbuf[3] = 1;
-	lbuf[6] = cmd;
-	hidapi_send(lbuf);
-#else
-	uint8_t data_bit;
-	for (int i = 7; i >= 0; i--) {
-		GPIO_WRITE(cspi_sck, 0);
-		data_bit = (cmd >> i) & 0x01;
-		if (spi_swap)
-			GPIO_WRITE(cspi_si, data_bit);
-		else
-			GPIO_WRITE(cspi_so, data_bit);
-		GPIO_WRITE(cspi_sck, 1);
-	}
-#endif
+// -p: <name>=<pin> pairs separated by commas
 
-}
+int pins_parse(char *map) {
 
-void spi_addr(uint32_t addr) {
+	const char *names[6] = { "ss", "so", "si", "sck", "cdone", "creset" };
+	uint8_t *pins[6] = { &cspi_ss, &cspi_so, &cspi_si, &cspi_sck, &cdone,
+		&creset };
+	char *save, *val, *end = NULL;
+	long n = -1;
+	int i;
 
-#ifdef BACKEND_LIBUSB
-  	int actual;
-	uint8_t lbuf[64];
-	bzero(lbuf, 64);
-	lbuf[0] = MUSLI_CMD_SPI_WRITE;
-	lbuf[1] = 3;
-	lbuf[4] = addr >> 16;
-	lbuf[5] = addr >> 8;
-	lbuf[6] = addr;
-	if (debug)
-		printf(" spi_addr [%.2x %.2x %.2x %.2x %.2x %.2x %.2x %.2x]\n",
-			lbuf[0], lbuf[1], lbuf[2], lbuf[3],
-			lbuf[4], lbuf[5], lbuf[6], lbuf[7]);
-  	libusb_bulk_transfer(usb_dh, (1 | LIBUSB_ENDPOINT_OUT), lbuf, 64,
-		&actual, 0);
-#elif BACKEND_HIDAPI
-	uint8_t lbuf[255];
-	bzero(lbuf, 255);
-	lbuf[2] = MUSLI_CMD_SPI_WRITE;
-	lbuf[3] = 3;
-	lbuf[6] = addr >> 16;
-	lbuf[7] = addr >> 8;
-	lbuf[8] = addr;
-	hidapi_send(lbuf);
-#else
-	uint8_t data_bit;
-	for (int i = 23; i >= 0; i--) {
-		GPIO_WRITE(cspi_sck, 0);
-		data_bit = (addr >> i) & 0x01;
-		if (spi_swap)
-			GPIO_WRITE(cspi_si, data_bit);
-		else
-			GPIO_WRITE(cspi_so, data_bit);
-		GPIO_WRITE(cspi_sck, 1);
+	for (char *tok = strtok_r(map, ",", &save); tok != NULL;
+			tok = strtok_r(NULL, ",", &save)) {
+		if ((val = strchr(tok, '=')) != NULL) {
+			*val++ = 0x00;
+			n = strtol(val, &end, 10);
+		}
+		for (i = 0; i < 6 && strcmp(tok, names[i]); i++);
+		if (val == NULL || i == 6 || end == val || *end || n < 0 ||
+				n >= PIN_UNSET) {
+			fprintf(stderr, "bad pin: %s\n", tok);
+			return -1;
+		}
+		*pins[i] = n;
 	}
-#endif
-
-}
 
-void spi_write(void *buf, uint32_t len) {
-
-#ifdef BACKEND_LIBUSB
-  	int actual;
-	uint8_t lbuf[64];
+	return 0;
 
-	uint32_t rlen = len;
-	uint32_t offset = 0;
+}
 
-	for (int blk = 0; blk < len / MUSLI_BLK_SIZE; blk++) {
+// set several pins at once: pins in dir_mask become outputs where their bit
+// in dir is set and inputs otherwise, then pins in out_mask are driven to
+// their bit in out
 
-		bzero(lbuf, 64);
-		lbuf[0] = MUSLI_CMD_SPI_WRITE;
-		lbuf[1] = MUSLI_BLK_SIZE;
-		if (buf != NULL)
-			memcpy(lbuf + 4, buf + offset, MUSLI_BLK_SIZE);
-  		libusb_bulk_transfer(usb_dh, (1 | LIBUSB_ENDPOINT_OUT), lbuf, 64,
-			&actual, 0);
+void gpio_set(uint64_t dir_mask, uint64_t dir, uint64_t out_mask, uint64_t out) {
 
-		if (debug) {
-  			printf("spi_write: [%i/%i]: ", offset, len);
-			for (int z = 0; z < 64; z++)
-  			  printf("[%.2x]", lbuf[z]);
-			printf("\n");
-		}
+	if (musli_caps.cmds & MUSLI_CAP_GPIO_MASK) {
+		uint8_t d[MUSLI_GPIO_MASK_LEN];
+		uint32_t v[4] = { dir_mask, dir, out_mask, out };
+		for (int i = 0; i < 16; i++)
+			d[i] = v[i / 4] >> ((i % 4) * 8);
+		musliCmdData(MUSLI_CMD_GPIO_SET_MASK, 0, 0, 0, d, MUSLI_GPIO_MASK_LEN);
+		return;
+	}
 
-		rlen -= MUSLI_BLK_SIZE;
-		offset += MUSLI_BLK_SIZE;
+	// otherwise pin by pin; async transports still send it all at once
+	if (tp->begin) tp->begin();
 
+	for (int pin = 0; pin < GPIO_MASK_PINS; pin++) {
+		if (dir_mask & PIN(pin))
+			GPIO_SET_MODE(pin, (dir & PIN(pin)) ? PI_OUTPUT : PI_INPUT);
 	}
 
-	if (rlen) {
-		bzero(lbuf, 64);
-		lbuf[0] = MUSLI_CMD_SPI_WRITE;
-		lbuf[1] = rlen;
-		if (debug) {
-  			printf("spi_write: [%i/%i]: ", offset, len);
-			for (int z = 0; z < rlen; z++)
-  			  printf("[%.2x]", lbuf[z]);
-			printf("\n");
-		}
-		if (buf != NULL)
-			memcpy(lbuf + 4, buf + offset, rlen);
-  		libusb_bulk_transfer(usb_dh, (1 | LIBUSB_ENDPOINT_OUT), lbuf, 64,
-			&actual, 0);
+	for (int pin = 0; pin < GPIO_MASK_PINS; pin++) {
+		if (out_mask & PIN(pin))
+			GPIO_WRITE(pin, (out & PIN(pin)) ? 1 : 0);
 	}
 
-#elif BACKEND_HIDAPI
-
-  	int actual;
-	uint8_t lbuf[255];
-
-	uint32_t rlen = len;
-	uint32_t offset = 0;
-
-	for (int blk = 0; blk < len / MUSLI_BLK_SIZE; blk++) {
+	if (tp->end) tp->end();
 
-		bzero(lbuf, 255);
-		lbuf[2] = MUSLI_CMD_SPI_WRITE;
-		lbuf[3] = MUSLI_BLK_SIZE;
-		if (buf != NULL)
-			memcpy(lbuf + 6, buf + offset, MUSLI_BLK_SIZE);
-		hidapi_send(lbuf);
+}
 
-		if (debug) {
-  			printf("spi_write: [%i/%i]: ", offset, len);
-			for (int z = 0; z < len; z++)
-  			  printf("[%.2x]", lbuf[z]);
-			printf("\n");
-		}
+// read the pins in mask; a single snapshot when the interface supports it
 
-		rlen -= MUSLI_BLK_SIZE;
-		offset += MUSLI_BLK_SIZE;
+uint64_t gpio_get(uint64_t mask) {
 
-	}
+	uint64_t val = 0;
+	uint8_t r[4];
 
-	if (rlen) {
-		bzero(lbuf, 255);
-		lbuf[2] = MUSLI_CMD_SPI_WRITE;
-		lbuf[3] = rlen;
-		if (debug) {
-  			printf("spi_write: [%i/%i]: ", offset, len);
-			for (int z = 0; z < rlen; z++)
-  			  printf("[%.2x]", lbuf[z]);
-			printf("\n");
+	if (tp->gpio_read_all) {
+		val = tp->gpio_read_all();
+	} else if ((musli_caps.cmds & MUSLI_CAP_GPIO_MASK) &&
+			musliQuery(MUSLI_CMD_GPIO_GET_ALL, 0, 0, 0, NULL, 0, r, 4,
+				MUSLI_READY_TIMEOUT) == 4) {
+		val = r[0] | (r[1] << 8) | (r[2] << 16) | ((uint32_t)r[3] << 24);
+	} else {
+		for (int pin = 0; pin < GPIO_MASK_PINS; pin++) {
+			if ((mask & PIN(pin)) && GPIO_READ(pin))
+				val |= PIN(pin);
 		}
-		if (buf != NULL)
-			memcpy(lbuf + 6, buf + offset, rlen);
-		hidapi_send(lbuf);
 	}
 
+	if (debug)
+		printf(" gpio_get: 0x%.16llx\n", (unsigned long long)val);
 
-#else
-
-	uint8_t data_bit;
-	uint8_t data_byte;
-
-	for (int p = 0; p < len; p++) {
+	return val & mask;
 
-		printf(" spi writing byte %i / %i\n", p, len);
+}
 
-		if (buf != NULL)
-			data_byte = *(unsigned char *)(buf + p);
+// assert SS and start a transaction; on async transports everything up to
+// the matching spi_end() is packed into as few transfers as possible
 
-		for (int i = 7; i >= 0; i--) {
-			GPIO_WRITE(cspi_sck, 0);
-			data_bit = (data_byte >> i) & 0x01;
-			if (spi_swap)
-				GPIO_WRITE(cspi_si, data_bit);
-			else
-				GPIO_WRITE(cspi_so, data_bit);
-			GPIO_WRITE(cspi_sck, 1);
-		}
+void spi_begin(void) {
+	if (tp->begin) tp->begin();
+	GPIO_WRITE(cspi_ss, spi_ss_active);
+}
 
-	}
+void spi_end(void) {
+	GPIO_WRITE(cspi_ss, spi_ss_inactive);
+	if (tp->end) tp->end();
+}
 
-#endif
+void spi_cmd(uint8_t cmd) {
+	if (debug)
+  		printf(" spi_cmd [%.2x]\n", cmd);
+	tp->spi_write(&cmd, 1);
+}
 
+void spi_addr(uint32_t addr) {
+	uint8_t abuf[3];
+	abuf[0] = addr >> 16;
+	abuf[1] = addr >> 8;
+	abuf[2] = addr;
+	if (debug)
+		printf(" spi_addr [%.2x %.2x %.2x]\n", abuf[0], abuf[1], abuf[2]);
+	tp->spi_write(abuf, 3);
 }
 
-void spi_read(void *buf, uint32_t len) {
-
-#ifdef BACKEND_LIBUSB
-  	int actual;
-	uint8_t lbuf[64];
+void spi_write(void *buf, uint32_t len) {
+	if (debug)
+		printf("spi_write: %i bytes\n", len);
+	tp->spi_write(buf, len);
+}
 
-	uint32_t rlen = len;
-	uint32_t offset = 0;
+void spi_read(void *buf, uint32_t len) {
+	tp->spi_read(buf, len);
+}
 
-	for (int blk = 0; blk < len / 64; blk++) {
+uint8_t spi_read_byte(void) {
+	uint8_t data_byte;
+	tp->spi_read(&data_byte, 1);
+	return data_byte;
+}
 
-		bzero(lbuf, 64);
-		musliCmd(MUSLI_CMD_SPI_READ, 64, 0, 0);
-  		libusb_bulk_transfer(usb_dh, (2 | LIBUSB_ENDPOINT_IN), lbuf, 64,
-			&actual, 0);
+// a whole SPI transaction: assert SS, write wlen bytes, read rlen bytes,
+// release SS. with SPI_XFER firmware each request carries its own SS
+// handling and returns the data in the same exchange; async transports
+// only use it when the reply fits one request, longer reads are cheaper
+// through their pipelined read path
 
-		if (buf != NULL)
-			memcpy(buf + offset, lbuf, 64);
+void spi_xfer(const uint8_t *wbuf, uint32_t wlen, uint8_t *rbuf, uint32_t rlen) {
 
-		if (debug) {
-	  		printf("spi_read: %i/%d [%i/%i]: ", actual, 64, offset, len);
-			for (int z = 0; z < actual; z++)
-	  		  printf("[%.2x]", lbuf[z]);
-			printf("\n");
-		}
+	if (debug)
+		printf(" spi_xfer: write %i read %i\n", wlen, rlen);
+
+	if ((musli_caps.cmds & MUSLI_CAP_SPI_XFER) && wlen <= musli_blk_size &&
+			(!tp->caps.async || rlen <= musli_reply_size)) {
+
+		uint8_t ss = (cspi_ss & MUSLI_XFER_PIN) |
+			(spi_ss_active ? MUSLI_XFER_SS_HIGH : 0);
+		uint32_t offset = 0;
+		uint32_t n;
+
+		do {
+			n = rlen - offset;
+			if (n > musli_reply_size) n = musli_reply_size;
+			if (musliSpiXfer(offset ? NULL : wbuf, offset ? 0 : wlen,
+					rbuf + offset, n, ss | (offset ? MUSLI_XFER_CONT : 0) |
+					(offset + n < rlen ? MUSLI_XFER_HOLD : 0))) {
+				fprintf(stderr, "spi_xfer failed\n");
+				break;
+			}
+			offset += n;
+		} while (offset < rlen);
 
-		rlen -= 64;
-		offset += 64;
+		if (offset >= rlen) return;
 
 	}
 
-	if (rlen) {
-		bzero(lbuf, 64);
-		musliCmd(MUSLI_CMD_SPI_READ, 64, 0, 0);
-  		libusb_bulk_transfer(usb_dh, (2 | LIBUSB_ENDPOINT_IN), lbuf, 64,
-			&actual, 0);
+	spi_begin();
+	spi_write((void *)wbuf, wlen);
+	spi_read(rbuf, rlen);
+	spi_end();
 
-		if (debug) {
-	  		printf("spi_read: %i/%d [%i/%i]: ", actual, 64, offset, len);
-			for (int z = 0; z < actual; z++)
-	  		  printf("[%.2x]", lbuf[z]);
-			printf("\n");
-		}
+}
 
-		if (buf != NULL)
-			memcpy(buf + offset, lbuf, rlen);
-	}
+uint8_t flash_status(void) {
 
-#elif BACKEND_HIDAPI
+	uint8_t cmd = 0x05;
+	uint8_t status;
 
-	uint8_t lbuf[255];
+	spi_xfer(&cmd, 1, &status, 1);
 
-	uint32_t rlen = len;
-	uint32_t offset = 0;
+	return(status);
 
-	for (int blk = 0; blk < len / MUSLI_BLK_SIZE; blk++) {
+}
 
-		bzero(lbuf, 255);
-		lbuf[2] = MUSLI_CMD_SPI_READ;
-		lbuf[3] = MUSLI_BLK_SIZE;
-		hidapi_send_get(lbuf);
+void flash_read(uint32_t addr, void *buf, uint32_t len) {
+	uint8_t cmd[4] = { 0x03, addr >> 16, addr >> 8, addr };
+	spi_xfer(cmd, 4, buf, len);
+}
 
-		if (buf != NULL)
-			memcpy(buf + offset, lbuf + 2, MUSLI_BLK_SIZE);
+// wait for WIP to clear, for at most FLASH_WAIT_MAX_MS in all; returns 0
+// when the flash is ready and -1 if it's still busy
 
-		if (debug) {
-	  		printf("spi_read: %d [%i/%i]: ", MUSLI_BLK_SIZE, offset, len);
-			for (int z = 0; z < MUSLI_BLK_SIZE; z++)
-	  		  printf("[%.2x]", lbuf[z+2]);
-			printf("\n");
-		}
+int flash_wait(void) {
 
-		rlen -= 128;
-		offset += 128;
+	uint64_t deadline = time_us() + (uint64_t)FLASH_WAIT_MAX_MS * 1000;
+	uint8_t status;
 
+	// let the device poll; it answers as soon as WIP clears
+	if (musli_caps.cmds & MUSLI_CAP_FLASH_WAIT) {
+		uint32_t elapsed;
+		int r;
+		while ((r = musliFlashWait(0x01, MUSLI_WAIT_TIMEOUT, &elapsed)) == 1 &&
+			time_us() < deadline);
+		if (r == 0) return 0;
 	}
 
-	if (rlen) {
-		bzero(lbuf, 255);
-		lbuf[2] = MUSLI_CMD_SPI_READ;
-		lbuf[3] = rlen;
-		hidapi_send_get(lbuf);
+	while (((status = flash_status()) & 0x01) == 0x01) {
+		if (time_us() >= deadline) {
+			progress_break();
+			fprintf(stderr, "flash still busy after %i s (status 0x%.2x)\n",
+				FLASH_WAIT_MAX_MS / 1000, status);
+			return -1;
+		}
+		usleep(100);
+	}
 
-		if (debug) {
-	  		printf("spi_read: %d [%i/%i]: ", rlen, offset, len);
-			for (int z = 0; z < len; z++)
-	  		  printf("[%.2x]", lbuf[z+2]);
-			printf("\n");
+	return 0;
+
+}
+
+uint64_t time_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t time_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// keep the bit banging from being preempted: SCHED_FIFO, optionally pinned
+// to one (ideally isolated) cpu, and all memory locked and faulted in, the
+// image buffer already read and some stack; each step that fails (no root
+// or CAP_SYS_NICE/CAP_IPC_LOCK) is reported and skipped
+
+void realtime_start(int cpu) {
+
+	struct sched_param sp = { .sched_priority = RT_PRIORITY };
+	volatile uint8_t stack[RT_STACK_PREFAULT];
+	int fifo = 1;
+	int locked = 1;
+
+	if (cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set)) {
+			perror("realtime: sched_setaffinity");
+			cpu = -1;
 		}
+	}
 
-		if (buf != NULL)
-			memcpy(buf + offset, lbuf + 2, rlen);
+	if (sched_setscheduler(0, SCHED_FIFO, &sp)) {
+		perror("realtime: sched_setscheduler");
+		fifo = 0;
 	}
 
+	if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+		perror("realtime: mlockall");
+		locked = 0;
+	}
 
-#else
-	uint8_t data_byte;
-	for (int p = 0; p < len; p++) {
+	for (int i = 0; i < RT_STACK_PREFAULT; i += 4096)
+		stack[i] = stack[i];
 
-		data_byte = spi_read_byte();
-		*(unsigned char *)(buf + p) = data_byte;
+	printf("realtime: %s, cpu %i, memory %s\n", fifo ? "SCHED_FIFO" : "not fifo",
+		cpu, locked ? "locked" : "not locked");
 
-	}
-#endif
+}
 
+// progress line with throughput and ETA for the long loops; they only pass
+// in a byte count, printing is rate limited (redrawn in place on a terminal,
+// an occasional line otherwise)
+
+struct progress {
+	const char *what;
+	uint64_t total;
+	uint64_t start_us;
+	uint64_t last_us;
+	int tty;
+	int drawn;		// a line without newline is on the terminal
+} progress;
+
+void progress_show(uint64_t done, uint64_t now) {
+	double secs = (now - progress.start_us) / 1e6;
+	double rate = secs > 0 ? done / secs : 0;
+	uint32_t eta = rate > 0 ? (progress.total - done) / rate : 0;
+	printf("%s %s: %llu/%llu bytes (%i%%), %.1f KB/s, eta %u:%.2u%s",
+		progress.tty ? "\r" : "", progress.what, (unsigned long long)done,
+		(unsigned long long)progress.total,
+		progress.total ? (int)(done * 100 / progress.total) : 100,
+		rate / 1024, eta / 60, eta % 60, progress.tty ? "" : "\n");
+	fflush(stdout);
+	progress.drawn = progress.tty;
+	progress.last_us = now;
 }
 
-uint8_t spi_read_byte(void) {
+void progress_start(const char *what, uint64_t total) {
+	progress.what = what;
+	progress.total = total;
+	progress.start_us = time_us();
+	progress.last_us = progress.start_us;
+	progress.tty = isatty(STDOUT_FILENO) && !debug;
+	progress.drawn = 0;
+}
 
-#ifdef BACKEND_LIBUSB
-   int actual;
-	uint8_t buf[64];
-	musliCmd(MUSLI_CMD_SPI_READ, 1, 0, 0);
-   libusb_bulk_transfer(usb_dh, (2 | LIBUSB_ENDPOINT_IN), buf, 64,
-      &actual, 0);
-	return buf[0];
-#elif BACKEND_HIDAPI
-	uint8_t buf[255];
-	buf[2] = MUSLI_CMD_SPI_READ;
-	buf[3] = 1;
-	hidapi_send_get(buf);
-	//printf(" spi_read_byte = %.2x\n", buf[2]);
-	return buf[2];
-#else
-	uint8_t data_bit;
-	uint8_t data_byte = 0x00;
-	for (int i = 7; i >= 0; i--) {
-		GPIO_WRITE(cspi_sck, 0);
-		GPIO_WRITE(cspi_sck, 1);
-		if (spi_swap)
-			data_bit = GPIO_READ(cspi_so);
-		else
-			data_bit = GPIO_READ(cspi_si);
-		data_byte |= data_bit << i;
-	}
+void progress_update(uint64_t done) {
+	uint64_t now = time_us();
+	if (now - progress.last_us >= (progress.tty ? PROGRESS_TTY_MS :
+			PROGRESS_LOG_MS) * 1000)
+		progress_show(done, now);
+}
 
-	return data_byte;
-#endif
+// end the progress line before printing something else
 
+void progress_break(void) {
+	if (progress.drawn) printf("\n");
+	progress.drawn = 0;
 }
 
-uint8_t flash_status(void) {
+void progress_end(uint64_t done) {
+	uint64_t now = time_us();
+	progress_show(done, now);
+	progress_break();
+}
 
-	uint8_t status;
+// CRC-32 (IEEE 802.3), as used by the musli firmware
 
-	GPIO_WRITE(cspi_ss, spi_ss_active);
-	spi_cmd(0x05);
-	status = spi_read_byte();
-	GPIO_WRITE(cspi_ss, spi_ss_inactive);
+uint32_t crc32(const uint8_t *buf, uint32_t len) {
+	uint32_t crc = 0xffffffff;
+	for (uint32_t i = 0; i < len; i++) {
+		crc ^= buf[i];
+		for (int b = 0; b < 8; b++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	return ~crc;
+}
 
-	return(status);
+// compare a flash range with buf; returns 0 if they match. uses a device-side
+// CRC when the interface supports it, otherwise reads the range back
 
-}
+int flash_check(uint32_t addr, const void *buf, uint32_t len) {
+
+	uint8_t vbuf[READ_BLK_SIZE];
+	uint32_t rlen;
+
+	uint32_t crc;
+	if ((musli_caps.cmds & MUSLI_CAP_CRC32) && !musliFlashCrc(addr, len, &crc))
+		return (crc == crc32(buf, len)) ? 0 : -1;
+
+	for (uint32_t i = 0; i < len; i += rlen) {
+
+		if (len - i >= READ_BLK_SIZE) rlen = READ_BLK_SIZE; else rlen = len - i;
+
+		flash_read(addr + i, vbuf, rlen);
+
+		if (memcmp(vbuf, buf + i, rlen)) return -1;
 
-void flash_wait(void) {
-	int status;
-	while (flash_status() & 0x01 == 0x01) {
-		usleep(100);
 	}
+
+	return 0;
+
 }
 
 void flash_write_enable(void) {
-	GPIO_WRITE(cspi_ss, spi_ss_active);
-	DELAY();
+	spi_begin();
 	spi_cmd(0x06);
-	DELAY();
-	GPIO_WRITE(cspi_ss, spi_ss_inactive);
+	spi_end();
 	usleep(5000);
 }
 
+// the serial number caches of the transports that open devices by path
+// (HID_CACHE_FILE, MUSLI_CACHE_FILE) hold one "<serial> <path>" line per
+// device; a path read back is only a hint, it's checked against the device
+
+int serial_cache_path(const char *name, char *path, size_t len) {
+	const char *dir = getenv("XDG_CACHE_HOME");
+	if (dir != NULL && *dir)
+		snprintf(path, len, "%s/%s", dir, name);
+	else if ((dir = getenv("HOME")) != NULL)
+		snprintf(path, len, "%s/.cache/%s", dir, name);
+	else
+		return -1;
+	return 0;
+}
+
+int serial_cache_get(const char *name, const char *serial, char *path,
+		size_t len) {
+
+	char file[256];
+	char line[512];
+	char s[128];
+	char p[256];
+	int r = -1;
+
+	if (serial_cache_path(name, file, sizeof(file))) return -1;
+	FILE *fp = fopen(file, "r");
+	if (fp == NULL) return -1;
+
+	while (r && fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%127s %255s", s, p) == 2 && !strcmp(s, serial)) {
+			snprintf(path, len, "%s", p);
+			r = 0;
+		}
+	}
+
+	fclose(fp);
+	return r;
+
+}
+
+void serial_cache_put(const char *name, const char *serial, const char *path) {
+
+	char file[256];
+	char lines[SERIAL_CACHE_MAX][512];
+	char s[128];
+	int n = 0;
+
+	if (serial_cache_path(name, file, sizeof(file))) return;
+
+	// keep the other entries (and drop this serial's old one)
+	FILE *fp = fopen(file, "r");
+	if (fp != NULL) {
+		while (n < SERIAL_CACHE_MAX - 1 && fgets(lines[n], 512, fp)) {
+			if (sscanf(lines[n], "%127s", s) == 1 && strcmp(s, serial))
+				n++;
+		}
+		fclose(fp);
+	}
+
+	// written aside and renamed over the old one, so that concurrent runs
+	// never see (or leave) a truncated cache
+	char tmp[300];
+	snprintf(tmp, sizeof(tmp), "%s.%d", file, (int)getpid());
+
+	if (serial_cache_mkdir(file) || (fp = fopen(tmp, "w")) == NULL) {
+		if (debug) perror(file);
+		return;
+	}
+	for (int i = 0; i < n; i++)
+		fputs(lines[i], fp);
+	fprintf(fp, "%s %s\n", serial, path);
+	if (fclose(fp) || rename(tmp, file)) {
+		if (debug) perror(file);
+		unlink(tmp);
+	}
+
+}
+
+// create the directories the cache file is in (private, like ~/.cache)
+
+int serial_cache_mkdir(const char *file) {
+
+	char dir[256];
+
+	snprintf(dir, sizeof(dir), "%s", file);
+	for (char *p = dir + 1; *p; p++) {
+		if (*p != '/') continue;
+		*p = 0x00;
+		if (mkdir(dir, 0700) && errno != EEXIST) return -1;
+		*p = '/';
+	}
+
+	return 0;
+
+}
+
 // ---
 
-#ifdef BACKEND_LIBUSB
+// open the named transport, or the first one that finds a device; pins
+// not set by a board option get that transport's default wiring
+
+int transport_open(const char *name) {
+
+	for (int t = 0; transports[t] != NULL; t++) {
+
+		if (name != NULL && strcmp(name, transports[t]->name)) continue;
+		if (transports[t]->open()) continue;
+
+		tp = transports[t];
+		printf("transport: %s\n", tp->name);
+
+		if (cspi_ss == PIN_UNSET) cspi_ss = tp->caps.ss;
+		if (cspi_so == PIN_UNSET) cspi_so = tp->caps.so;
+		if (cspi_si == PIN_UNSET) cspi_si = tp->caps.si;
+		if (cspi_sck == PIN_UNSET) cspi_sck = tp->caps.sck;
+		if (cdone == PIN_UNSET) cdone = tp->caps.cdone;
+		if (creset == PIN_UNSET) creset = tp->caps.creset;
+
+		// the pins are bits of gpio_set/gpio_get masks
+		uint8_t wiring[6] = { cspi_ss, cspi_so, cspi_si, cspi_sck, cdone, creset };
+		for (int i = 0; i < 6; i++) {
+			if (wiring[i] >= tp->caps.pins) {
+				fprintf(stderr, "pin %i out of range (%s takes 0-%i)\n",
+					wiring[i], tp->name, tp->caps.pins - 1);
+				tp->close();
+				exit(1);
+			}
+		}
+
+		if (tp->caps.compound)
+			musliProbe();
+
+		return 0;
+
+	}
+
+	return -1;
+
+}
+
+// ---
 
 void musliInit(uint8_t mode) {
 	musliCmd(MUSLI_CMD_INIT, mode, 0, 0);
 }
 
 void musliCmd(uint8_t cmd, uint8_t arg1, uint8_t arg2, uint8_t arg3) {
-   int actual;
-	uint8_t buf[64];
-	bzero(buf, 64);
-	buf[0] = cmd;
-	buf[1] = arg1;
-	buf[2] = arg2;
-	buf[3] = arg3;
+	musliCmdData(cmd, arg1, arg2, arg3, NULL, 0);
+}
+
+void musliCmdData(uint8_t cmd, uint8_t arg1, uint8_t arg2, uint8_t arg3,
+		const uint8_t *data, uint8_t dlen) {
+	if (!tp->caps.compound) {
+		fprintf(stderr, "%s: musli commands not supported\n", tp->name);
+		return;
+	}
 	if (debug)
 		printf("send cmd [%.2x %.2x %.2x %.2x]\n", cmd, arg1, arg2, arg3);
-   libusb_bulk_transfer(usb_dh, (1 | LIBUSB_ENDPOINT_OUT), buf, 64,
-      &actual, 0);
+	tp->musli_cmd(cmd, arg1, arg2, arg3, data, dlen);
+}
+
+// send the payload of a data command (SPI_WRITE, BUF_WRITE) in blocks of
+// musli_blk_size (buf == NULL sends zeros)
+
+void musliOut(uint8_t cmd, const uint8_t *buf, uint32_t len) {
+	tp->musli_out(cmd, buf, len);
+}
+
+// send a command and wait up to timeout ms for its reply; returns the reply
+// length or -1
+
+int musliQuery(uint8_t cmd, uint8_t arg1, uint8_t arg2, uint8_t arg3,
+		const uint8_t *data, uint8_t dlen, uint8_t *reply, int len, int timeout) {
+	if (!tp->caps.compound) return -1;
+	if (debug)
+		printf("send cmd [%.2x %.2x %.2x %.2x]\n", cmd, arg1, arg2, arg3);
+	return tp->musli_query(cmd, arg1, arg2, arg3, data, dlen, reply, len,
+		timeout);
 }
 
 // bit banging interface
@@ -1265,92 +1887,1205 @@ void musliWrite(uint8_t pin, uint8_t val) {
 	musliCmd(MUSLI_CMD_GPIO_PUT, pin, val, 0);
 }
 
-uint8_t musliRead(uint8_t pin) {
-   int actual;
-	uint8_t buf[64];
-	musliCmd(MUSLI_CMD_GPIO_GET, pin, 0, 0);
-   libusb_bulk_transfer(usb_dh, (2 | LIBUSB_ENDPOINT_IN), buf, 64,
-      &actual, 0);
-	return buf[0];
+// ask the firmware what it supports and pick the fastest settings we can use
+
+void musliProbe(void) {
+	uint8_t r[MUSLI_READY_MAX_LEN];
+	const int clks[] = MUSLI_SPI_CLKS;
+
+	musli_blk_size = tp->caps.blk_size;
+	musli_reply_size = tp->caps.blk_size;
+	musli_caps.max_payload = tp->caps.blk_size;
+
+	bzero(r, MUSLI_READY_MAX_LEN);
+	if (musliQuery(MUSLI_CMD_READY, 0, 0, 0, NULL, 0, r, MUSLI_READY_MAX_LEN,
+			MUSLI_READY_TIMEOUT) < MUSLI_READY_LEN || r[0] != 'M' || r[1] != 'U') {
+		printf("musli: legacy firmware\n");
+		return;
+	}
+
+	musli_caps.version = r[2];
+	musli_caps.max_payload = r[3];
+	musli_caps.spi_clocks = r[4];
+	musli_caps.cmds = r[5] | (r[6] << 8) | (r[7] << 16) | ((uint32_t)r[8] << 24);
+	musli_caps.max_reply = r[9];
+
+	if (tp->caps.max_payload && musli_caps.max_payload > tp->caps.max_payload)
+		musli_blk_size = tp->caps.max_payload;
+	else if (musli_caps.max_payload)
+		musli_blk_size = musli_caps.max_payload;
+
+	// replies carry no command header, so they may hold more than a request
+	musli_reply_size = musli_blk_size;
+	if (musli_caps.max_reply && tp->caps.max_reply) {
+		musli_reply_size = musli_caps.max_reply;
+		if (musli_reply_size > tp->caps.max_reply)
+			musli_reply_size = tp->caps.max_reply;
+	}
+
+	for (int i = 0; i < 8; i++) {
+		if ((musli_caps.spi_clocks & (1 << i)) && clks[i] <= SPI_MAX_KHZ)
+			musli_spi_clk = i;
+	}
+
+	printf("musli: protocol v%i, payload %i/%i, spi clock %i kHz, caps 0x%.8x\n",
+		musli_caps.version, musli_blk_size, musli_reply_size,
+		musli_spi_clk < 0 ? 0 : clks[musli_spi_clk], musli_caps.cmds);
 }
 
-#elif BACKEND_HIDAPI
+void musliSetClock(void) {
+	if (musli_spi_clk >= 0)
+		musliCmd(MUSLI_CMD_CFG_SPI_CLK, musli_spi_clk, 0, 0);
+}
 
-void hidapi_send(uint8_t *buf) {
-	buf[0] = 0xaa;
-	buf[1] = 0x00;
-	int r = hid_send_feature_report(usb_hd, buf, 255);
-	if (r != 255) {
-		fprintf(stderr, "hidapi_send failed (r = %d)\n", r);
+// upload a 4K sector and let the device erase, program and check it;
+// returns 0 if the device reports success and the readback CRC matches
+
+int musliProgramSector(uint32_t addr, const uint8_t *data) {
+	uint8_t r[MUSLI_SECTOR_REPLY_LEN];
+	uint32_t crc;
+
+	musliOut(MUSLI_CMD_BUF_WRITE, data, MUSLI_SECTOR_SIZE);
+
+	if (musliQuery(MUSLI_CMD_FLASH_PROG_SECTOR, addr >> 16, addr >> 8, addr,
+			NULL, 0, r, MUSLI_SECTOR_REPLY_LEN, MUSLI_SECTOR_TIMEOUT) !=
+			MUSLI_SECTOR_REPLY_LEN) {
+		printf("[no reply] ");
+		return -1;
 	}
-	retry:;
-	r = hid_get_feature_report(usb_hd, buf, 255);
-	// printf("buf: %x %x %x %x %x\n", buf[0], buf[1], buf[2], buf[3], buf[4]);
-	if (r != 255 || buf[0] != 0xaa) {
-		fprintf(stderr, "hidapi_get failed (r = %d)\n", r);
+
+	crc = r[1] | (r[2] << 8) | (r[3] << 16) | ((uint32_t)r[4] << 24);
+
+	if (debug)
+		printf("[status: 0x%.2x crc: %.8x] ", r[0], crc);
+
+	if (r[0] != 0x00) {
+		printf("[status: 0x%.2x] ", r[0]);
+		return -1;
 	}
-	if (buf[1] != 0x01) goto retry;
+
+	return (crc == crc32(data, MUSLI_SECTOR_SIZE)) ? 0 : -1;
 }
 
-void hidapi_send_get(uint8_t *buf) {
-	buf[0] = 0xaa;
-	buf[1] = 0x00;
-	int r = hid_send_feature_report(usb_hd, buf, 255);
-	if (r != 255) {
-		fprintf(stderr, "hidapi_send_get failed (r = %d)\n", r);
+// have the device checksum a flash range; returns 0 on success
+
+int musliFlashCrc(uint32_t addr, uint32_t len, uint32_t *crc) {
+	uint8_t r[MUSLI_CRC_REPLY_LEN];
+	uint8_t l[4];
+
+	l[0] = len;
+	l[1] = len >> 8;
+	l[2] = len >> 16;
+	l[3] = len >> 24;
+
+	if (musliQuery(MUSLI_CMD_FLASH_CRC32, addr >> 16, addr >> 8, addr,
+			l, 4, r, MUSLI_CRC_REPLY_LEN, MUSLI_CRC_TIMEOUT) !=
+			MUSLI_CRC_REPLY_LEN || r[0] != 0x00)
+		return -1;
+
+	*crc = r[1] | (r[2] << 8) | (r[3] << 16) | ((uint32_t)r[4] << 24);
+	return 0;
+}
+
+// have the device poll the flash status until the mask bits clear; returns
+// 0 when ready, 1 on device-side timeout and -1 if the request failed
+
+int musliFlashWait(uint8_t mask, uint16_t timeout, uint32_t *elapsed) {
+	uint8_t r[MUSLI_WAIT_REPLY_LEN];
+
+	if (musliQuery(MUSLI_CMD_FLASH_WAIT, mask, timeout, timeout >> 8,
+			NULL, 0, r, MUSLI_WAIT_REPLY_LEN, timeout + 500) !=
+			MUSLI_WAIT_REPLY_LEN)
+		return -1;
+
+	*elapsed = r[2] | (r[3] << 8) | (r[4] << 16) | ((uint32_t)r[5] << 24);
+
+	if (debug)
+		printf(" flash_wait: status 0x%.2x after %u us%s\n", r[0], *elapsed,
+			r[1] ? " (timeout)" : "");
+
+	return r[1] ? 1 : 0;
+}
+
+// one SPI_XFER request (flags: MUSLI_XFER_*); returns 0 or -1
+
+int musliSpiXfer(const uint8_t *wbuf, uint8_t wlen, uint8_t *rbuf,
+		uint8_t rlen, uint8_t flags) {
+	uint8_t r[256];
+	if (musliQuery(MUSLI_CMD_SPI_XFER, wlen, rlen, flags, wbuf, wlen, r,
+			rlen, MUSLI_XFER_TIMEOUT) != rlen)
+		return -1;
+	memcpy(rbuf, r, rlen);
+	return 0;
+}
+
+// ---
+
+#ifdef BACKEND_LIBUSB
+
+struct transport transport_libusb = {
+	.name = "libusb",
+	.open = musliUsbOpen,
+	.close = musliUsbClose,
+	.list = musliList,
+	.gpio_mode = musliSetMode,
+	.gpio_write = musliWrite,
+	.gpio_read = musliUsbRead,
+	.spi_write = musliUsbSpiWrite,
+	.spi_read = musliSpiIn,
+	.begin = musliBegin,
+	.end = musliEnd,
+	.musli_cmd = musliUsbCmd,
+	.musli_out = musliUsbOut,
+	.musli_query = musliUsbQuery,
+	.caps = {
+		.max_payload = MUSLI_PKT_SIZE - 4,
+		.blk_size = MUSLI_PKT_SIZE - 4,
+		.max_reply = MUSLI_PKT_SIZE,
+		.async = 1,
+		.compound = 1,
+		.init_release = 1,
+		.pins = 32,		// MUSLI_CMD_GPIO_SET_MASK masks
+		.ss = 9, .so = 8, .si = 11, .sck = 10, .cdone = 2, .creset = 3,
+	},
+};
+
+int musliUsbOpen(void) {
+	if (libusb_init(NULL) < 0) {
+		fprintf(stderr, "usb init error\n");
+		return -1;
 	}
-	retry:;
-	r = hid_get_feature_report(usb_hd, buf, 255);
-	// printf("buf: %x %x %x %x %x\n", buf[0], buf[1], buf[2], buf[3], buf[4]);
-	if (r != 255 || buf[0] != 0xaa) {
-		fprintf(stderr, "hidapi_send_get failed (r = %d)\n", r);
+	usb_dh = musliOpen(usb_bus, usb_addr, usb_path, usb_serial, usb_wait);
+	if (!usb_dh) {
+		libusb_exit(NULL);
+		return -1;
 	}
-	if (buf[1] != 0x01) goto retry;
+	musliStart();
+	return 0;
 }
 
-void hidapi_get(uint8_t *buf) {
-	retry:;
-	int r = hid_get_feature_report(usb_hd, buf, 255);
-	// printf("buf: %x %x %x %x %x\n", buf[0], buf[1], buf[2], buf[3], buf[4]);
-	if (r != 255 || buf[0] != 0xaa) {
-		fprintf(stderr, "hidapi_get failed (r = %d)\n", r);
+void musliUsbClose(void) {
+	musliStop();
+	libusb_close(usb_dh);
+	usb_dh = NULL;
+	libusb_exit(NULL);
+}
+
+void musliUsbCmd(uint8_t cmd, uint8_t arg1, uint8_t arg2, uint8_t arg3,
+		const uint8_t *data, uint8_t dlen) {
+	musliPktData(cmd, arg1, arg2, arg3, data, dlen);
+	if (!musli_txq_open) {
+		musliFlush();
+		musliSync();
 	}
-	printf("A: %2x\n", buf[1]);
-	if (buf[1] != 0x01) goto retry;
-	printf("B: %2x\n", buf[1]);
 }
 
-void musliInit(uint8_t mode) {
-	musliCmd(MUSLI_CMD_INIT, mode, 0, 0);
+// batch everything up to the matching musliEnd() into as few transfers as
+// possible; musliEnd() waits until the batch has been sent
+
+void musliBegin(void) {
+	musli_txq_open++;
 }
 
-void musliCmd(uint8_t cmd, uint8_t arg1, uint8_t arg2, uint8_t arg3) {
-   int actual;
-	uint8_t buf[255];
-	bzero(buf, 255);
-	buf[0] = 0xaa;
-	buf[1] = 0x00;
-	buf[2] = cmd;
-	buf[3] = arg1;
-	buf[4] = arg2;
-	buf[5] = arg3;
-	if (debug)
-		printf("send cmd [%.2x %.2x %.2x %.2x]\n", cmd, arg1, arg2, arg3);
-	hidapi_send(buf);
+void musliEnd(void) {
+	if (musli_txq_open && --musli_txq_open == 0) {
+		musliFlush();
+		musliSync();
+	}
 }
 
-// bit banging interface
+// transmit queue; commands are packed back-to-back as 64-byte packets and
+// sent as one bulk transfer, the device still sees one command per packet.
+// up to usb_queue_depth transfers are kept in flight; completions are reaped
+// by an event thread. OUT transfers complete in order, so reads only need
+// their request flushed, anything timing sensitive calls musliSync().
+
+// packets are built in place in the transfer buffer; only the header is
+// written, the device ignores payload bytes past the length it was given
+
+uint8_t *musliPkt(uint8_t cmd, uint8_t arg1, uint8_t arg2, uint8_t arg3) {
+	if (musli_txq_pkts == MUSLI_TXQ_PKTS)
+		musliFlush();
+	uint8_t *pkt = musli_txq + (musli_txq_pkts++ * MUSLI_PKT_SIZE);
+	pkt[0] = cmd;
+	pkt[1] = arg1;
+	pkt[2] = arg2;
+	pkt[3] = arg3;
+	return pkt;
+}
 
-void musliSetMode(uint8_t pin, uint8_t dir) {
-	musliCmd(MUSLI_CMD_GPIO_SET_DIR, pin, dir, 0);
+// packet with a fixed-size payload; the rest of it is zeroed
+
+uint8_t *musliPktData(uint8_t cmd, uint8_t arg1, uint8_t arg2, uint8_t arg3,
+		const uint8_t *data, uint8_t dlen) {
+	uint8_t *pkt = musliPkt(cmd, arg1, arg2, arg3);
+	if (data == NULL) dlen = 0;
+	if (dlen > MUSLI_PKT_SIZE - 4) dlen = MUSLI_PKT_SIZE - 4;
+	if (dlen)
+		memcpy(pkt + 4, data, dlen);
+	bzero(pkt + 4 + dlen, MUSLI_PKT_SIZE - 4 - dlen);
+	return pkt;
 }
 
-void musliWrite(uint8_t pin, uint8_t val) {
-	musliCmd(MUSLI_CMD_GPIO_PUT, pin, val, 0);
+// queue the payload of a data command (SPI_WRITE, BUF_WRITE), filling up the
+// previous packet of the same command first so that opcode, address and
+// data share packets (buf == NULL sends zeros)
+
+void musliUsbOut(uint8_t cmd, const uint8_t *buf, uint32_t len) {
+	uint8_t *pkt;
+	uint32_t n;
+	while (len) {
+		pkt = NULL;
+		if (musli_txq_pkts) {
+			pkt = musli_txq + ((musli_txq_pkts - 1) * MUSLI_PKT_SIZE);
+			if (pkt[0] != cmd || pkt[1] >= musli_blk_size)
+				pkt = NULL;
+		}
+		if (pkt == NULL)
+			pkt = musliPkt(cmd, 0, 0, 0);
+		n = musli_blk_size - pkt[1];
+		if (n > len) n = len;
+		if (buf != NULL) {
+			memcpy(pkt + 4 + pkt[1], buf, n);
+			buf += n;
+		} else {
+			bzero(pkt + 4 + pkt[1], n);
+		}
+		pkt[1] += n;
+		len -= n;
+	}
 }
 
-uint8_t musliRead(uint8_t pin) {
-	uint8_t buf[255];
+void musliUsbSpiWrite(const uint8_t *buf, uint32_t len) {
+	musliUsbOut(MUSLI_CMD_SPI_WRITE, buf, len);
+	if (!musli_txq_open) musliFlush();
+}
+
+// pipelined read; keeps up to usb_queue_depth SPI_READ requests and their IN
+// transfers outstanding and copies the replies out in order. each request
+// asks only for the bytes still needed, so a short tail reads a short packet
+
+void musliSpiIn(uint8_t *buf, uint32_t len) {
+	uint32_t chunks = (len + MUSLI_PKT_SIZE - 1) / MUSLI_PKT_SIZE;
+	uint32_t sent = 0;
+	uint32_t done = 0;
+	uint32_t n;
+	struct musli_rx *rx;
+
+	while (done < chunks) {
+
+		while (sent < chunks && sent - done < usb_queue_depth) {
+			n = len - (sent * MUSLI_PKT_SIZE);
+			if (n > MUSLI_PKT_SIZE) n = MUSLI_PKT_SIZE;
+			rx = &musli_rx_slots[sent % usb_queue_depth];
+			libusb_fill_bulk_transfer(rx->xfer, usb_dh, (2 | LIBUSB_ENDPOINT_IN),
+				rx->buf, MUSLI_PKT_SIZE, musliXferDone, &rx->busy, 0);
+			rx->busy = 1;
+			int r = libusb_submit_transfer(rx->xfer);
+			if (r < 0) {
+				fprintf(stderr, "usb submit failed (r = %d)\n", r);
+				rx->busy = 0;
+			}
+			musliPkt(MUSLI_CMD_SPI_READ, n, 0, 0);
+			sent++;
+		}
+		musliFlush();
+
+		// wait for the oldest reply, then take whatever else has arrived
+		pthread_mutex_lock(&musli_lock);
+		do {
+			rx = &musli_rx_slots[done % usb_queue_depth];
+			while (rx->busy)
+				pthread_cond_wait(&musli_cond, &musli_lock);
+
+			n = len - (done * MUSLI_PKT_SIZE);
+			if (n > MUSLI_PKT_SIZE) n = MUSLI_PKT_SIZE;
+			if (rx->xfer->actual_length < n)
+				musli_xfer_status = LIBUSB_TRANSFER_ERROR;
+			if (buf != NULL)
+				memcpy(buf + (done * MUSLI_PKT_SIZE), rx->buf, n);
+
+			if (debug) {
+				printf("spi_read: %i/%i [%i/%i]: ", rx->xfer->actual_length, n,
+					done * MUSLI_PKT_SIZE, len);
+				for (int z = 0; z < n; z++)
+					printf("[%.2x]", rx->buf[z]);
+				printf("\n");
+			}
+
+			done++;
+		} while (done < sent && !musli_rx_slots[done % usb_queue_depth].busy);
+		pthread_mutex_unlock(&musli_lock);
+
+	}
+
+	if (musli_xfer_status) {
+		fprintf(stderr, "spi_read failed (status = %d)\n", musli_xfer_status);
+		musli_xfer_status = 0;
+	}
+}
+
+void musliFlush(void) {
+	struct musli_slot *slot = &musli_slots[musli_slot_cur];
+	if (!musli_txq_pkts) return;
+	if (debug) {
+		for (int p = 0; p < musli_txq_pkts; p++) {
+			printf("usb out [%i/%i]: ", p + 1, musli_txq_pkts);
+			for (int z = 0; z < MUSLI_PKT_SIZE; z++)
+				printf("[%.2x]", musli_txq[p * MUSLI_PKT_SIZE + z]);
+			printf("\n");
+		}
+	}
+
+	libusb_fill_bulk_transfer(slot->xfer, usb_dh, (1 | LIBUSB_ENDPOINT_OUT),
+		slot->buf, musli_txq_pkts * MUSLI_PKT_SIZE, musliXferDone, &slot->busy, 0);
+
+	pthread_mutex_lock(&musli_lock);
+	slot->busy = 1;
+	pthread_mutex_unlock(&musli_lock);
+
+	int r = libusb_submit_transfer(slot->xfer);
+	if (r < 0) {
+		fprintf(stderr, "usb submit failed (r = %d)\n", r);
+		slot->busy = 0;
+	}
+
+	// move on to the next slot, waiting for it if it is still in flight
+	musli_slot_cur = (musli_slot_cur + 1) % usb_queue_depth;
+	slot = &musli_slots[musli_slot_cur];
+
+	pthread_mutex_lock(&musli_lock);
+	while (slot->busy)
+		pthread_cond_wait(&musli_cond, &musli_lock);
+	pthread_mutex_unlock(&musli_lock);
+
+	musli_txq = slot->buf;
+	musli_txq_pkts = 0;
+}
+
+void musliXferDone(struct libusb_transfer *xfer) {
+	int *busy = xfer->user_data;
+	pthread_mutex_lock(&musli_lock);
+	if (xfer->status != LIBUSB_TRANSFER_COMPLETED)
+		musli_xfer_status = xfer->status;
+	*busy = 0;
+	pthread_cond_broadcast(&musli_cond);
+	pthread_mutex_unlock(&musli_lock);
+}
+
+// wait until every submitted transfer has completed
+
+void musliSync(void) {
+	pthread_mutex_lock(&musli_lock);
+	for (int i = 0; i < usb_queue_depth; i++) {
+		while (musli_slots[i].busy)
+			pthread_cond_wait(&musli_cond, &musli_lock);
+	}
+	if (musli_xfer_status) {
+		fprintf(stderr, "usb transfer failed (status = %d)\n",
+			musli_xfer_status);
+		musli_xfer_status = 0;
+	}
+	pthread_mutex_unlock(&musli_lock);
+}
+
+void *musliEvents(void *arg) {
+	struct timeval tv;
+	while (musli_ev_run) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 100000;
+		libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+	}
+	return NULL;
+}
+
+// transfer buffers for all slots come from one block of DMA-able memory
+// mapped by usbfs (libusb_dev_mem_alloc), so the kernel needn't copy them;
+// page aligned heap memory is used where that is not available
+
+void musliStart(void) {
+	size_t tx_len = MUSLI_TXQ_PKTS * MUSLI_PKT_SIZE;
+	if (usb_queue_depth < 1) usb_queue_depth = 1;
+	if (usb_queue_depth > MUSLI_MAX_DEPTH) usb_queue_depth = MUSLI_MAX_DEPTH;
+
+	musli_mem_len = usb_queue_depth * (tx_len + MUSLI_PKT_SIZE);
+	musli_mem = libusb_dev_mem_alloc(usb_dh, musli_mem_len);
+	musli_mem_dev = (musli_mem != NULL);
+	if (!musli_mem_dev && posix_memalign((void **)&musli_mem, 4096,
+			musli_mem_len)) {
+		fprintf(stderr, "usb buffer allocation failed\n");
+		exit(1);
+	}
+	if (debug)
+		printf("usb buffers: %zu bytes (%s)\n", musli_mem_len,
+			musli_mem_dev ? "dma" : "heap");
+
+	for (int i = 0; i < usb_queue_depth; i++) {
+		musli_slots[i].xfer = libusb_alloc_transfer(0);
+		musli_slots[i].buf = musli_mem + (i * tx_len);
+		musli_slots[i].busy = 0;
+		musli_rx_slots[i].xfer = libusb_alloc_transfer(0);
+		musli_rx_slots[i].buf = musli_mem + (usb_queue_depth * tx_len) +
+			(i * MUSLI_PKT_SIZE);
+		musli_rx_slots[i].busy = 0;
+	}
+	musli_slot_cur = 0;
+	musli_txq = musli_slots[0].buf;
+	musli_txq_pkts = 0;
+	musli_ev_run = 1;
+	pthread_create(&musli_ev_thread, NULL, musliEvents, NULL);
+}
+
+void musliStop(void) {
+	musliFlush();
+	musliSync();
+	musli_ev_run = 0;
+	pthread_join(musli_ev_thread, NULL);
+	for (int i = 0; i < usb_queue_depth; i++) {
+		libusb_free_transfer(musli_slots[i].xfer);
+		libusb_free_transfer(musli_rx_slots[i].xfer);
+	}
+	if (musli_mem_dev)
+		libusb_dev_mem_free(usb_dh, musli_mem, musli_mem_len);
+	else
+		free(musli_mem);
+	musli_mem = NULL;
+}
+
+// --
+// device selection
+// --
+
+// open the requested device (any bus/addr, path or serial left at -1/NULL
+// matches). bus/addr and port paths are opened directly where possible,
+// without walking the device list, and so is a serial whose port path was
+// remembered from an earlier run (MUSLI_CACHE_FILE); with wait >= 0 we wait
+// for the device to be plugged in (wait seconds, 0 = forever)
+
+libusb_device_handle *musliOpen(int bus, int addr, const char *path,
+		const char *serial, int wait) {
+
+	libusb_device_handle *dh = NULL;
+
+#ifdef MUSLI_SYS_OPEN
+	char cached[32];
+
+	if (bus == -1 && path == NULL && serial != NULL &&
+			!serial_cache_get(MUSLI_CACHE_FILE, serial, cached, sizeof(cached)) &&
+			(dh = musliOpenSys(-1, -1, cached)) != NULL) {
+		if (musliSerialIs(dh, serial)) {
+			if (debug) printf("using %s (cached)\n", cached);
+			return dh;
+		}
+		libusb_close(dh);
+		dh = NULL;
+	}
+
+	if (bus != -1 || path != NULL) {
+		dh = musliOpenSys(bus, addr, path);
+		if (dh && serial != NULL && !musliSerialIs(dh, serial)) {
+			libusb_close(dh);
+			dh = NULL;
+		}
+		if (dh) {
+			if (debug) printf("using %s\n", path ? path : "bus/addr");
+			return dh;
+		}
+	}
+#endif
+
+	if (wait >= 0) {
+		dh = musliWaitDevice(bus, addr, path, serial, wait);
+	} else {
+		libusb_device **list = NULL;
+		ssize_t count = libusb_get_device_list(NULL, &list);
+		for (ssize_t idx = 0; idx < count && !dh; ++idx)
+			musliMatch(list[idx], bus, addr, path, serial, &dh);
+		if (count > 0)
+			libusb_free_device_list(list, 1);
+	}
+
+#ifdef MUSLI_SYS_OPEN
+	if (dh && serial != NULL) {
+		musliPortPath(libusb_get_device(dh), cached, sizeof(cached));
+		serial_cache_put(MUSLI_CACHE_FILE, serial, cached);
+	}
+#endif
+
+	return dh;
+
+}
+
+#ifdef MUSLI_SYS_OPEN
+
+int musliSysAttr(const char *path, const char *attr) {
+	char name[128];
+	int val = -1;
+	snprintf(name, sizeof(name), "/sys/bus/usb/devices/%s/%s", path, attr);
+	FILE *fp = fopen(name, "r");
+	if (fp == NULL) return -1;
+	if (fscanf(fp, "%i", &val) != 1) val = -1;
+	fclose(fp);
+	return val;
+}
+
+// open the usbfs node and hand it to libusb; the port path is resolved to
+// bus/addr through sysfs
+
+libusb_device_handle *musliOpenSys(int bus, int addr, const char *path) {
+
+	char name[32];
+	libusb_device_handle *dh = NULL;
+	struct libusb_device_descriptor desc = {0};
+
+	if (path != NULL) {
+		int b = musliSysAttr(path, "busnum");
+		int a = musliSysAttr(path, "devnum");
+		if (b < 0 || a < 0) return NULL;
+		if (bus != -1 && (b != bus || a != addr)) return NULL;
+		bus = b;
+		addr = a;
+	}
+
+	snprintf(name, sizeof(name), "/dev/bus/usb/%03i/%03i", bus, addr);
+	int fd = open(name, O_RDWR);
+	if (fd < 0) return NULL;
+
+	if (libusb_wrap_sys_device(NULL, fd, &dh) != 0) {
+		close(fd);
+		return NULL;
+	}
+
+	libusb_get_device_descriptor(libusb_get_device(dh), &desc);
+	if (desc.idVendor != USB_MFG_ID || desc.idProduct != USB_DEV_ID ||
+			!musliIsVendor(libusb_get_device(dh))) {
+		libusb_close(dh);
+		close(fd);
+		return NULL;
+	}
+
+	// the fd stays open as long as the process runs
+	return dh;
+
+}
+
+#endif
+
+// wait for a matching device using hotplug notifications; devices already
+// plugged in are reported right away (LIBUSB_HOTPLUG_ENUMERATE)
+
+libusb_device_handle *musliWaitDevice(int bus, int addr, const char *path,
+		const char *serial, int wait) {
+
+	libusb_device_handle *dh = NULL;
+	libusb_hotplug_callback_handle cb;
+	time_t deadline = time(NULL) + wait;
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		fprintf(stderr, "usb hotplug not supported on this platform\n");
+		return NULL;
+	}
+
+	if (libusb_hotplug_register_callback(NULL,
+			LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_ENUMERATE,
+			USB_MFG_ID, USB_DEV_ID, LIBUSB_HOTPLUG_MATCH_ANY,
+			musliArrived, NULL, &cb) != LIBUSB_SUCCESS) {
+		fprintf(stderr, "usb hotplug error\n");
+		return NULL;
+	}
+
+	if (!musli_arrived_cnt)
+		printf("waiting for device ...\n");
+
+	while (1) {
+
+		// match outside the callback, libusb_open() isn't allowed there
+		for (int i = 0; i < musli_arrived_cnt; i++) {
+			if (!dh)
+				musliMatch(musli_arrived[i], bus, addr, path, serial, &dh);
+			libusb_unref_device(musli_arrived[i]);
+		}
+		musli_arrived_cnt = 0;
+
+		if (dh || (wait && time(NULL) >= deadline)) break;
+
+		struct timeval tv = { 0, 100000 };
+		libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+
+	}
+
+	libusb_hotplug_deregister_callback(NULL, cb);
+
+	return dh;
+
+}
+
+int musliArrived(libusb_context *ctx, libusb_device *dev,
+		libusb_hotplug_event event, void *user_data) {
+	if (musli_arrived_cnt < MUSLI_HOTPLUG_MAX)
+		musli_arrived[musli_arrived_cnt++] = libusb_ref_device(dev);
+	return 0;
+}
+
+// returns 1 and an open handle in dh if dev is the requested device
+
+int musliMatch(libusb_device *dev, int bus, int addr, const char *path,
+		const char *serial, libusb_device_handle **dh) {
+
+	struct libusb_device_descriptor desc = {0};
+	char str[32];
+
+	if (libusb_get_device_descriptor(dev, &desc) != 0) return 0;
+	if (desc.idVendor != USB_MFG_ID || desc.idProduct != USB_DEV_ID) return 0;
+	if (!musliIsVendor(dev)) return 0;
+
+	if (bus != -1 && (bus != libusb_get_bus_number(dev) ||
+			addr != libusb_get_device_address(dev)))
+		return 0;
+
+	if (path != NULL) {
+		musliPortPath(dev, str, sizeof(str));
+		if (strcmp(path, str)) return 0;
+	}
+
+	if (libusb_open(dev, dh) != 0) {
+		*dh = NULL;
+		return 0;
+	}
+
+	if (serial != NULL && !musliSerialIs(*dh, serial)) {
+		libusb_close(*dh);
+		*dh = NULL;
+		return 0;
+	}
+
+	if (debug)
+		printf("using bus %i addr %i\n", libusb_get_bus_number(dev),
+			libusb_get_device_address(dev));
+
+	return 1;
+
+}
+
+// the HID firmware has the same ids; leave it to the hidapi transport
+
+int musliIsVendor(libusb_device *dev) {
+	struct libusb_config_descriptor *cfg;
+	int vendor = 1;
+	if (libusb_get_active_config_descriptor(dev, &cfg) != 0) return 1;
+	if (cfg->bNumInterfaces && cfg->interface[0].num_altsetting &&
+			cfg->interface[0].altsetting[0].bInterfaceClass == LIBUSB_CLASS_HID)
+		vendor = 0;
+	libusb_free_config_descriptor(cfg);
+	return vendor;
+}
+
+int musliSerialIs(libusb_device_handle *dh, const char *serial) {
+	struct libusb_device_descriptor desc = {0};
+	unsigned char str[64];
+	libusb_get_device_descriptor(libusb_get_device(dh), &desc);
+	if (!desc.iSerialNumber) return 0;
+	if (libusb_get_string_descriptor_ascii(dh, desc.iSerialNumber, str,
+			sizeof(str)) < 0)
+		return 0;
+	return strcmp(serial, (char *)str) == 0;
+}
+
+// "<bus>-<port>[.<port>...]", the same names as in /sys/bus/usb/devices;
+// unlike the address this stays the same when the device is replugged
+
+void musliPortPath(libusb_device *dev, char *path, int len) {
+	uint8_t ports[7];
+	int n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	int pos = snprintf(path, len, "%i", libusb_get_bus_number(dev));
+	for (int i = 0; i < n && pos < len; i++)
+		pos += snprintf(path + pos, len - pos, "%c%i", i ? '.' : '-', ports[i]);
+}
+
+void musliList(void) {
+
+	libusb_device **list = NULL;
+	ssize_t count = libusb_get_device_list(NULL, &list);
+	int found = 0;
+
+	printf("devices found: \n");
+
+	for (ssize_t idx = 0; idx < count; ++idx) {
+
+		libusb_device *dev = list[idx];
+		libusb_device_handle *dh = NULL;
+		struct libusb_device_descriptor desc = {0};
+		unsigned char serial[64] = "?";
+		char path[32];
+
+		if (libusb_get_device_descriptor(dev, &desc) != 0) continue;
+		if (desc.idVendor != USB_MFG_ID || desc.idProduct != USB_DEV_ID) continue;
+
+		if (desc.iSerialNumber && libusb_open(dev, &dh) == 0) {
+			if (libusb_get_string_descriptor_ascii(dh, desc.iSerialNumber,
+					serial, sizeof(serial)) < 0)
+				strcpy((char *)serial, "?");
+			libusb_close(dh);
+		}
+
+		musliPortPath(dev, path, sizeof(path));
+
+		printf(" vendor %04x id %04x serial %s bus %i addr %i path %s\n",
+			desc.idVendor, desc.idProduct, serial,
+			libusb_get_bus_number(dev), libusb_get_device_address(dev), path);
+
+		found++;
+
+	}
+
+	if (!found) printf("none.\n");
+
+	if (count > 0)
+		libusb_free_device_list(list, 1);
+
+}
+
+// send a command and wait up to timeout ms for its reply packet; returns
+// the reply length or -1
+
+int musliUsbQuery(uint8_t cmd, uint8_t arg1, uint8_t arg2, uint8_t arg3,
+		const uint8_t *data, uint8_t dlen, uint8_t *reply, int len, int timeout) {
+	int actual = 0;
+	uint8_t buf[MUSLI_PKT_SIZE];
+	musliPktData(cmd, arg1, arg2, arg3, data, dlen);
+	musliFlush();
+	musliSync();
+	int r = libusb_bulk_transfer(usb_dh, (2 | LIBUSB_ENDPOINT_IN), buf,
+		MUSLI_PKT_SIZE, &actual, timeout);
+	if (r != 0) return -1;
+	if (actual > len) actual = len;
+	memcpy(reply, buf, actual);
+	return actual;
+}
+
+uint8_t musliUsbRead(uint8_t pin) {
+   int actual;
+	uint8_t buf[64];
+	musliCmd(MUSLI_CMD_GPIO_GET, pin, 0, 0);
+	musliFlush();
+   libusb_bulk_transfer(usb_dh, (2 | LIBUSB_ENDPOINT_IN), buf, 64,
+      &actual, 0);
+	return buf[0];
+}
+
+#endif
+
+#ifdef BACKEND_HIDAPI
+
+struct transport transport_hidapi = {
+	.name = "hidapi",
+	.open = musliHidOpen,
+	.close = musliHidClose,
+	.list = musliHidList,
+	.gpio_mode = musliSetMode,
+	.gpio_write = musliWrite,
+	.gpio_read = musliHidRead,
+	.spi_write = musliHidSpiWrite,
+	.spi_read = musliHidSpiIn,
+	.begin = musliHidBegin,
+	.end = musliHidEnd,
+	.musli_cmd = musliHidCmd,
+	.musli_out = musliHidOut,
+	.musli_query = musliHidQuery,
+	.caps = {
+		.max_payload = HID_BLK_MAX,
+		.blk_size = HID_BLK_SIZE,
+		.max_reply = HID_REPLY_MAX,
+		.async = 0,
+		.compound = 1,
+		.init_release = 0,
+		.pins = 32,		// MUSLI_CMD_GPIO_SET_MASK masks
+		.ss = 4, .so = 7, .si = 6, .sck = 5, .cdone = 2, .creset = 3,
+	},
+};
+
+int musliHidOpen(void) {
+	uint64_t start = time_us();
+	if (usb_path != NULL)
+		usb_hd = hid_open_path(usb_path);
+	else if (usb_serial != NULL)
+		usb_hd = hidapi_open_serial(usb_serial);
+	else
+		usb_hd = hid_open( USB_MFG_ID, USB_DEV_ID, L"0000");
+	hid_open_us = time_us() - start;
+	return usb_hd ? 0 : -1;
+}
+
+void musliHidList(void) {
+
+	struct hid_device_info *devs = hid_enumerate(USB_MFG_ID, USB_DEV_ID);
+
+	printf("hid devices found: \n");
+
+	for (struct hid_device_info *d = devs; d != NULL; d = d->next) {
+		printf(" vendor %04x id %04x serial %ls path %s\n", d->vendor_id,
+			d->product_id, d->serial_number ? d->serial_number : L"?", d->path);
+	}
+
+	if (devs == NULL) printf("none.\n");
+
+	hid_free_enumeration(devs);
+
+}
+
+// open the device with this serial; a path remembered from an earlier run
+// is tried first (and checked), so that only a miss needs an enumeration
+
+hid_device *hidapi_open_serial(const char *serial) {
+
+	char path[256];
+	wchar_t wserial[64];
+	hid_device *dev;
+
+	if (!serial_cache_get(HID_CACHE_FILE, serial, path, sizeof(path)) &&
+			(dev = hid_open_path(path)) != NULL) {
+		if (!hid_get_serial_number_string(dev, wserial, 64) &&
+				hidapi_serial_is(wserial, serial))
+			return dev;
+		hid_close(dev);
+	}
+
+	struct hid_device_info *devs = hid_enumerate(USB_MFG_ID, USB_DEV_ID);
+	dev = NULL;
+
+	for (struct hid_device_info *d = devs; d != NULL; d = d->next) {
+		if (d->serial_number == NULL || !hidapi_serial_is(d->serial_number, serial))
+			continue;
+		if ((dev = hid_open_path(d->path)) != NULL) {
+			serial_cache_put(HID_CACHE_FILE, serial, d->path);
+			break;
+		}
+	}
+
+	hid_free_enumeration(devs);
+	return dev;
+
+}
+
+int hidapi_serial_is(const wchar_t *w, const char *serial) {
+	while (*serial) {
+		if (*w++ != (unsigned char)*serial++) return 0;
+	}
+	return *w == 0;
+}
+
+void musliHidClose(void) {
+	hidapi_flush();
+	if (hid_unacked) hidapi_sync();
+	if (show_stats) hidapi_show_stats();
+	hid_close(usb_hd);
+	usb_hd = NULL;
+}
+
+// with feature reports (the default) every command waits for its ack. in
+// stream mode (MUSLI_CAP_HID_STREAM) commands go out as interrupt OUT
+// reports without waiting and only requests flagged HID_REPLY get an input
+// report back, in order; several reads can be in flight, and as everything
+// uses the interrupt pipes nothing overtakes a queued write.
+//
+// with MUSLI_CAP_HID_SYNC commands without a reply aren't acked in either
+// mode; a sync barrier goes out before the next request that wants a reply,
+// every HID_SYNC_MAX commands and on close
+
+int hidapi_write(uint8_t *buf, int reply) {
+	int r;
+	if (buf != hid_txq) hidapi_flush();
+	if (hid_unacked && (reply || hid_unacked >= HID_SYNC_MAX)) {
+		if (hidapi_sync()) return -1;
+	}
+	buf[0] = 0xaa;
+	buf[1] = (HID_STREAM && reply) ? HID_REPLY : 0x00;
+	if (HID_SYNC) {
+		hid_seq = (hid_seq + 1) & 0x7f;
+		memcpy(hid_sent[hid_seq], buf + 2, 4);
+		buf[1] |= hid_seq << 1;
+	}
+	if (!HID_STREAM) {
+		r = hid_send_feature_report(usb_hd, buf, 255);
+		if (r != 255) {
+			fprintf(stderr, "hidapi_send failed (r = %d)\n", r);
+			return -1;
+		}
+		// the reply, if any, is fetched by hidapi_read()
+		if (reply) return 0;
+		if (HID_SYNC) {
+			hid_unacked++;
+			return 0;
+		}
+		return hidapi_wait(buf, HID_TIMEOUT);
+	}
+	r = hid_write(usb_hd, buf, 255);
+	if (r != 255) {
+		fprintf(stderr, "hid_write failed (r = %d)\n", r);
+		return -1;
+	}
+	if (!reply && HID_SYNC) hid_unacked++;
+	return 0;
+}
+
+// wait until the device has handled everything sent so far; returns 0, or
+// -1 after naming the first command it reports as failed
+
+int hidapi_sync(void) {
+	uint8_t buf[255];
+	int pending = hid_unacked;
+
+	hid_unacked = 0;
+	bzero(buf, 255);
+	buf[2] = MUSLI_CMD_SYNC;
+	if (hidapi_send_get_timeout(buf, HID_TIMEOUT)) return -1;
+	if (!buf[2]) return 0;
+
+	uint8_t *c = hid_sent[buf[3] & 0x7f];
+	fprintf(stderr, "hidapi: %i of the last %i commands failed, first: "
+		"cmd 0x%.2x [%.2x %.2x %.2x] (seq %i), error 0x%.2x\n", buf[2],
+		pending, buf[4], c[1], c[2], c[3], buf[3], buf[5]);
+	return -1;
+}
+
+// fetch the reply to the oldest request sent with reply set; buf[2] should
+// still hold its command (for hid_stats). returns 0 or -1
+
+int hidapi_read(uint8_t *buf, int timeout) {
+	if (!HID_STREAM)
+		return hidapi_wait(buf, timeout);
+	uint8_t cmd = buf[2];
+	uint64_t start = time_us();
+	int r = hid_read_timeout(usb_hd, buf, 255, timeout);
+	if (r < 3 || buf[0] != 0xaa) {
+		fprintf(stderr, "hidapi: no reply to cmd 0x%.2x after %i ms (r = %d)\n",
+			cmd, timeout, r);
+		return -1;
+	}
+	hidapi_stat(cmd, time_us() - start, 1);
+	return 0;
+}
+
+void hidapi_send(uint8_t *buf) {
+	hidapi_write(buf, 0);
+}
+
+void hidapi_send_get(uint8_t *buf) {
+	if (!hidapi_write(buf, 1))
+		hidapi_read(buf, HID_TIMEOUT);
+}
+
+void hidapi_get(uint8_t *buf) {
+	hidapi_read(buf, HID_TIMEOUT);
+}
+
+// like hidapi_send_get() but with its own timeout in ms; returns 0 or -1
+
+int hidapi_send_get_timeout(uint8_t *buf, int timeout) {
+	if (hidapi_write(buf, 1)) return -1;
+	return hidapi_read(buf, timeout);
+}
+
+// wait until the device has answered the report just sent (buf[1] == 0x01);
+// polls back to back for HID_SPIN_US, which covers most commands, then
+// backs off so that slow ones don't keep a core busy. returns 0, or -1
+// after timeout ms; the time taken is added to hid_stats
+
+int hidapi_wait(uint8_t *buf, int timeout) {
+
+	uint8_t cmd = buf[2];
+	uint64_t start = time_us();
+	uint64_t elapsed;
+	uint32_t sleep_us = HID_SLEEP_MIN_US;
+	uint32_t polls = 0;
+	int r;
+
+	while (1) {
+
+		r = hid_get_feature_report(usb_hd, buf, 255);
+		polls++;
+		elapsed = time_us() - start;
+
+		if (r == 255 && buf[0] == 0xaa && buf[1] == 0x01) break;
+
+		if (elapsed >= timeout * 1000ULL) {
+			fprintf(stderr, "hidapi: no reply to cmd 0x%.2x after %i ms (r = %d)\n",
+				cmd, timeout, r);
+			return -1;
+		}
+
+		if (elapsed >= HID_SPIN_US) {
+			usleep(sleep_us);
+			if (sleep_us < HID_SLEEP_MAX_US) sleep_us *= 2;
+		}
+
+	}
+
+	hidapi_stat(cmd, elapsed, polls);
+
+	return 0;
+
+}
+
+void hidapi_stat(uint8_t cmd, uint64_t elapsed, uint32_t polls) {
+	hid_stats[cmd].count++;
+	hid_stats[cmd].polls += polls;
+	hid_stats[cmd].total_us += elapsed;
+	if (elapsed > hid_stats[cmd].max_us) hid_stats[cmd].max_us = elapsed;
+}
+
+void hidapi_show_stats(void) {
+	printf("hidapi latency:\n");
+	printf(" open: %llu us\n", (unsigned long long)hid_open_us);
+	for (int c = 0; c < 256; c++) {
+		struct hid_stat *st = &hid_stats[c];
+		if (!st->count) continue;
+		printf(" cmd 0x%.2x: %u calls, avg %llu us, max %u us, %.1f polls\n",
+			c, st->count, (unsigned long long)(st->total_us / st->count),
+			st->max_us, (double)st->polls / st->count);
+	}
+}
+
+int musliHidQuery(uint8_t cmd, uint8_t arg1, uint8_t arg2, uint8_t arg3,
+		const uint8_t *data, uint8_t dlen, uint8_t *reply, int len, int timeout) {
+	uint8_t buf[255];
+	bzero(buf, 255);
+	buf[2] = cmd;
+	buf[3] = arg1;
+	buf[4] = arg2;
+	buf[5] = arg3;
+	if (data != NULL)
+		memcpy(buf + 6, data, dlen);
+	if (hidapi_send_get_timeout(buf, timeout)) return -1;
+	if (len > 253) len = 253;
+	memcpy(reply, buf + 2, len);
+	return len;
+}
+
+// fill hid_txq with the payload of a data command (SPI_WRITE, BUF_WRITE),
+// sending it whenever it is full; between begin and end the last partial
+// report waits for more data of the same command, so that opcode, address
+// and data share reports (buf == NULL sends zeros). any other report sends
+// it first
+
+void musliHidOut(uint8_t cmd, const uint8_t *buf, uint32_t len) {
+	uint32_t n;
+
+	while (len) {
+
+		if (hid_txq[3] && hid_txq[2] != cmd)
+			hidapi_flush();
+
+		hid_txq[2] = cmd;
+		n = musli_blk_size - hid_txq[3];
+		if (n > len) n = len;
+
+		if (buf != NULL) {
+			memcpy(hid_txq + 6 + hid_txq[3], buf, n);
+			buf += n;
+		} else {
+			bzero(hid_txq + 6 + hid_txq[3], n);
+		}
+		hid_txq[3] += n;
+		len -= n;
+
+		if (hid_txq[3] >= musli_blk_size)
+			hidapi_flush();
+
+	}
+
+	if (!hid_txq_open)
+		hidapi_flush();
+}
+
+void hidapi_flush(void) {
+	if (!hid_txq[3]) return;
+	if (debug) {
+		printf("musli_out: %i: ", hid_txq[3]);
+		for (int z = 0; z < hid_txq[3] + 6; z++)
+			printf("[%.2x]", hid_txq[z]);
+		printf("\n");
+	}
+	hidapi_send(hid_txq);
+	bzero(hid_txq, 255);
+}
+
+void musliHidBegin(void) {
+	hid_txq_open = 1;
+}
+
+void musliHidEnd(void) {
+	hid_txq_open = 0;
+	hidapi_flush();
+}
+
+void musliHidCmd(uint8_t cmd, uint8_t arg1, uint8_t arg2, uint8_t arg3,
+		const uint8_t *data, uint8_t dlen) {
+	uint8_t buf[255];
+	bzero(buf, 255);
+	buf[0] = 0xaa;
+	buf[1] = 0x00;
+	buf[2] = cmd;
+	buf[3] = arg1;
+	buf[4] = arg2;
+	buf[5] = arg3;
+	if (data != NULL)
+		memcpy(buf + 6, data, dlen);
+	hidapi_send(buf);
+}
+
+void musliHidSpiWrite(const uint8_t *buf, uint32_t len) {
+	musliHidOut(MUSLI_CMD_SPI_WRITE, buf, len);
+}
+
+// reads in blocks of musli_reply_size, keeping up to HID_STREAM_DEPTH requests
+// in flight in stream mode (one at a time with feature reports)
+
+void musliHidSpiIn(uint8_t *buf, uint32_t len) {
+
+	uint8_t lbuf[255];
+	uint32_t chunks = (len + musli_reply_size - 1) / musli_reply_size;
+	uint32_t depth = HID_STREAM ? HID_STREAM_DEPTH : 1;
+	uint32_t sent = 0;
+	uint32_t done = 0;
+	uint32_t n;
+
+	while (done < chunks) {
+
+		while (sent < chunks && sent - done < depth) {
+			n = len - (sent * musli_reply_size);
+			if (n > musli_reply_size) n = musli_reply_size;
+			bzero(lbuf, 255);
+			lbuf[2] = MUSLI_CMD_SPI_READ;
+			lbuf[3] = n;
+			if (hidapi_write(lbuf, 1)) return;
+			sent++;
+		}
+
+		n = len - (done * musli_reply_size);
+		if (n > musli_reply_size) n = musli_reply_size;
+
+		lbuf[2] = MUSLI_CMD_SPI_READ;
+		if (hidapi_read(lbuf, HID_TIMEOUT)) return;
+
+		if (debug) {
+	  		printf("spi_read: %d [%i/%i]: ", n, done * musli_reply_size, len);
+			for (int z = 0; z < n; z++)
+	  		  printf("[%.2x]", lbuf[z+2]);
+			printf("\n");
+		}
+
+		if (buf != NULL)
+			memcpy(buf + (done * musli_reply_size), lbuf + 2, n);
+
+		done++;
+
+	}
+
+}
+
+uint8_t musliHidRead(uint8_t pin) {
+	uint8_t buf[255];
 	bzero(buf, 255);
 	buf[0] = 0xaa;
 	buf[1] = 0x00;
@@ -1361,3 +3096,746 @@ uint8_t musliRead(uint8_t pin) {
 }
 
 #endif
+
+#ifdef BACKEND_PIGPIO
+
+struct transport transport_pigpio = {
+	.name = "pigpio",
+	.open = pigpioOpen,
+	.close = pigpioClose,
+	.gpio_mode = pigpioSetMode,
+	.gpio_write = pigpioWrite,
+	.gpio_read = pigpioRead,
+	.gpio_read_all = pigpioReadAll,
+	.spi_write = pigpioSpiWrite,
+	.spi_read = pigpioSpiRead,
+	.caps = {
+		.max_payload = 0,
+		.blk_size = 0,
+		.max_reply = 0,
+		.async = 0,
+		.compound = 0,
+		.init_release = 0,
+		.pins = 32,		// bank 0 set/clear/level registers
+		.ss = 25, .so = 9, .si = 10, .sck = 11, .cdone = 24, .creset = 23,
+	},
+};
+
+int pigpioOpen(void) {
+	if (gpioInitialise() < 0) {
+		fprintf(stderr, "gpio init error\n");
+		return -1;
+	}
+	return 0;
+}
+
+void pigpioClose(void) {
+	if (pigpio_spi >= 0)
+		spiClose(pigpio_spi);
+	gpioTerminate();
+	if (show_stats && pigpio_stats.count) {
+		printf("pigpio byte time: %llu bytes, min %llu ns, avg %llu ns, "
+			"max %llu ns, %llu over %i us\n",
+			(unsigned long long)pigpio_stats.count,
+			(unsigned long long)pigpio_stats.min_ns,
+			(unsigned long long)(pigpio_stats.total_ns / pigpio_stats.count),
+			(unsigned long long)pigpio_stats.max_ns,
+			(unsigned long long)pigpio_stats.stalls, PIGPIO_STALL_NS / 1000);
+	}
+}
+
+// time of one bit banged byte, for the jitter summary of -L
+
+void pigpio_stat(uint64_t ns) {
+	pigpio_stats.count++;
+	pigpio_stats.total_ns += ns;
+	if (ns < pigpio_stats.min_ns) pigpio_stats.min_ns = ns;
+	if (ns > pigpio_stats.max_ns) pigpio_stats.max_ns = ns;
+	if (ns > PIGPIO_STALL_NS) pigpio_stats.stalls++;
+}
+
+void pigpioSetMode(uint8_t pin, uint8_t dir) {
+	gpioSetMode(pin, dir);
+}
+
+void pigpioWrite(uint8_t pin, uint8_t val) {
+	gpioWrite(pin, val);
+}
+
+uint8_t pigpioRead(uint8_t pin) {
+	return gpioRead(pin);
+}
+
+uint64_t pigpioReadAll(void) {
+	return gpioRead_Bits_0_31();
+}
+
+// use SPI0 when the clock and the data pins (as swapped for this transfer)
+// are its SCLK, MOSI and MISO; SS and CRESET stay under software control,
+// the CE lines aren't used. mode 3, as the bit banged clock idles high
+
+int pigpioSpiHw(void) {
+
+	uint8_t out = spi_swap ? cspi_si : cspi_so;
+	uint8_t in = spi_swap ? cspi_so : cspi_si;
+
+	if (spi_khz == 0 || pigpio_spi_failed || cspi_sck != PIGPIO_SPI_SCLK ||
+			out != PIGPIO_SPI_MOSI || in != PIGPIO_SPI_MISO)
+		return 0;
+
+	if (pigpio_spi < 0) {
+		int khz = spi_khz > 0 ? spi_khz : PIGPIO_SPI_KHZ;
+		pigpio_spi = spiOpen(0, khz * 1000, 3 | (3 << 5));
+		if (pigpio_spi < 0) {
+			fprintf(stderr, "spi open error (%d), bit banging\n", pigpio_spi);
+			pigpio_spi_failed = 1;
+			return 0;
+		}
+		if (debug)
+			printf("pigpio: hardware spi at %i kHz\n", khz);
+	}
+
+	// the pins may have been used as plain gpios since the last transfer
+	gpioSetMode(PIGPIO_SPI_SCLK, PI_ALT0);
+	gpioSetMode(PIGPIO_SPI_MOSI, PI_ALT0);
+	gpioSetMode(PIGPIO_SPI_MISO, PI_ALT0);
+
+	return 1;
+
+}
+
+// hardware SPI if the wiring allows, else bit banging; the data pin depends
+// on spi_swap. the bit banging works on whole registers: the clock and data
+// masks are worked out once per call, each bit is one clear (clock low,
+// data low if it's a 0), one set of the data line only where it goes high,
+// and one set of the clock; reads sample every pin at once
+
+#define BANG_OUT(bit) \
+	if (data_byte & (bit)) { \
+		gpioWrite_Bits_0_31_Clear(sck); \
+		if (!hi) { gpioWrite_Bits_0_31_Set(data); hi = 1; } \
+	} else { \
+		gpioWrite_Bits_0_31_Clear(sck | data); \
+		hi = 0; \
+	} \
+	gpioWrite_Bits_0_31_Set(sck);
+
+#define BANG_IN(shift) \
+	gpioWrite_Bits_0_31_Clear(sck); \
+	gpioWrite_Bits_0_31_Set(sck); \
+	data_byte |= ((gpioRead_Bits_0_31() >> pin) & 1) << (shift);
+
+#define BANG_OUT_BYTE \
+	BANG_OUT(0x80); BANG_OUT(0x40); BANG_OUT(0x20); BANG_OUT(0x10); \
+	BANG_OUT(0x08); BANG_OUT(0x04); BANG_OUT(0x02); BANG_OUT(0x01);
+
+#define BANG_IN_BYTE \
+	BANG_IN(7); BANG_IN(6); BANG_IN(5); BANG_IN(4); \
+	BANG_IN(3); BANG_IN(2); BANG_IN(1); BANG_IN(0);
+
+// with -L each byte is timed in a loop of its own, so that the plain loop
+// does nothing but bang
+
+void pigpioSpiWrite(const uint8_t *buf, uint32_t len) {
+
+	uint8_t data_byte = 0x00;
+	uint8_t pin = spi_swap ? cspi_si : cspi_so;
+	uint32_t sck = PIN(cspi_sck);
+	uint32_t data = PIN(pin);
+	int hi = 0;		// data line known to be high
+
+	if (pigpioSpiHw()) {
+		while (len) {
+			uint32_t n = len > PIGPIO_SPI_CHUNK ? PIGPIO_SPI_CHUNK : len;
+			spiWrite(pigpio_spi, buf != NULL ? (char *)buf : pigpio_spi_zero, n);
+			if (buf != NULL) buf += n;
+			len -= n;
+		}
+		return;
+	}
+
+	if (spi_wave && len >= PIGPIO_WAVE_MIN) {
+		uint32_t n = pigpioWaveWrite(buf, len);
+		if (buf != NULL) buf += n;
+		len -= n;
+	}
+
+	if (show_stats) {
+		for (int p = 0; p < len; p++) {
+			if (buf != NULL)
+				data_byte = buf[p];
+			uint64_t t0 = time_ns();
+			BANG_OUT_BYTE
+			pigpio_stat(time_ns() - t0);
+		}
+		return;
+	}
+
+	for (int p = 0; p < len; p++) {
+
+		if (debug)
+			printf(" spi writing byte %i / %i\n", p, len);
+
+		if (buf != NULL)
+			data_byte = buf[p];
+
+		BANG_OUT_BYTE
+
+	}
+
+}
+
+void pigpioSpiRead(uint8_t *buf, uint32_t len) {
+
+	uint8_t data_byte;
+	uint8_t pin = spi_swap ? cspi_so : cspi_si;
+	uint32_t sck = PIN(cspi_sck);
+
+	if (pigpioSpiHw()) {
+		while (len) {
+			uint32_t n = len > PIGPIO_SPI_CHUNK ? PIGPIO_SPI_CHUNK : len;
+			spiRead(pigpio_spi, buf != NULL ? (char *)buf : pigpio_spi_drop, n);
+			if (buf != NULL) buf += n;
+			len -= n;
+		}
+		return;
+	}
+
+	if (show_stats) {
+		for (int p = 0; p < len; p++) {
+			data_byte = 0x00;
+			uint64_t t0 = time_ns();
+			BANG_IN_BYTE
+			pigpio_stat(time_ns() - t0);
+			if (buf != NULL)
+				buf[p] = data_byte;
+		}
+		return;
+	}
+
+	for (int p = 0; p < len; p++) {
+
+		data_byte = 0x00;
+
+		BANG_IN_BYTE
+
+		if (buf != NULL)
+			buf[p] = data_byte;
+
+	}
+
+}
+
+// stream a long write as DMA waveforms of PIGPIO_WAVE_BYTES: while one is
+// clocked out the next is built and queued behind it (ONE_SHOT_SYNC), so
+// the clock runs at a fixed rate with the CPU mostly asleep. each bit is
+// two pulses of half a clock period, clock low with the data, then clock
+// high. if the waveform memory runs out (deleted waves are only reused in
+// order) the queue is drained and cleared, which just pauses the clock.
+// returns the number of bytes sent
+
+uint32_t pigpioWaveWrite(const uint8_t *buf, uint32_t len) {
+
+	uint32_t sck = PIN(cspi_sck);
+	uint32_t data = PIN(spi_swap ? cspi_si : cspi_so);
+	uint32_t half = spi_khz > 0 ? 500 / spi_khz : 1;
+	uint32_t done = 0;
+	uint32_t n;
+	int prev = -1;
+	int cur;
+
+	if (half < 1) half = 1;
+
+	gpioWaveClear();
+
+	while (done < len) {
+
+		n = len - done;
+		if (n > PIGPIO_WAVE_BYTES) n = PIGPIO_WAVE_BYTES;
+
+		gpioPulse_t *p = pigpio_pulses;
+		for (uint32_t i = 0; i < n; i++) {
+			uint8_t b = buf != NULL ? buf[done + i] : 0x00;
+			for (int bit = 7; bit >= 0; bit--) {
+				p->gpioOn = ((b >> bit) & 1) ? data : 0;
+				p->gpioOff = ((b >> bit) & 1) ? sck : sck | data;
+				p->usDelay = half;
+				p++;
+				p->gpioOn = sck;
+				p->gpioOff = 0;
+				p->usDelay = half;
+				p++;
+			}
+		}
+
+		for (int tries = 0; ; tries++) {
+			gpioWaveAddNew();
+			gpioWaveAddGeneric(n * 16, pigpio_pulses);
+			if ((cur = gpioWaveCreate()) >= 0 || tries) break;
+			pigpioWaveWait(n * 4 * half);
+			gpioWaveClear();
+			prev = -1;
+		}
+		if (cur < 0) {
+			fprintf(stderr, "wave create error (%d), bit banging\n", cur);
+			break;
+		}
+
+		gpioWaveTxSend(cur, PI_WAVE_MODE_ONE_SHOT_SYNC);
+
+		// the previous chunk is done once this one is on air
+		if (prev >= 0) {
+			while (gpioWaveTxAt() == prev)
+				gpioDelay(n * 4 * half);
+			gpioWaveDelete(prev);
+		}
+
+		prev = cur;
+		done += n;
+
+	}
+
+	pigpioWaveWait(PIGPIO_WAVE_BYTES * 4 * half);
+	gpioWaveClear();
+
+	return done;
+
+}
+
+void pigpioWaveWait(uint32_t poll_us) {
+	while (gpioWaveTxBusy())
+		gpioDelay(poll_us);
+}
+
+#endif
+
+#ifdef BACKEND_SPIDEV
+
+// generic Linux boards: the pins are lines of a gpiochip, driven through
+// the GPIO character device (v2 uAPI, no libgpiod needed), and SRAM loads
+// go through /dev/spidevX.Y. pin numbers are line offsets on the chip
+
+struct transport transport_spidev = {
+	.name = "spidev",
+	.open = spidevOpen,
+	.close = spidevClose,
+	.gpio_mode = spidevSetMode,
+	.gpio_write = spidevWrite,
+	.gpio_read = spidevRead,
+	.gpio_read_all = spidevReadAll,
+	.spi_write = spidevSpiWrite,
+	.spi_read = spidevSpiRead,
+	.caps = {
+		.max_payload = 0,
+		.blk_size = 0,
+		.max_reply = 0,
+		.async = 0,
+		.compound = 0,
+		.init_release = 0,
+		.pins = GPIO_MASK_PINS,
+		.ss = 25, .so = 9, .si = 10, .sck = 11, .cdone = 24, .creset = 23,
+	},
+};
+
+int spidevOpen(void) {
+
+	const char *chip = gpio_chip_path ? gpio_chip_path : SPIDEV_CHIP;
+	const char *dev = spidev_path ? spidev_path : SPIDEV_DEV;
+
+	spidev_chip = open(chip, O_RDWR | O_CLOEXEC);
+	if (spidev_chip < 0) {
+		fprintf(stderr, "%s: %s\n", chip, strerror(errno));
+		return -1;
+	}
+
+	// the default wiring is in Raspberry Pi GPIO numbers, which are line
+	// offsets only on the Pi's own controllers; anywhere else every pin
+	// has to come from a board option or -p
+	struct gpiochip_info info;
+	memset(&info, 0, sizeof(info));
+	if (ioctl(spidev_chip, GPIO_GET_CHIPINFO_IOCTL, &info) < 0) {
+		fprintf(stderr, "%s: %s\n", chip, strerror(errno));
+		spidevClose();
+		return -1;
+	}
+
+	if (strncmp(info.label, "pinctrl-bcm", 11) &&
+			strncmp(info.label, "pinctrl-rp1", 11) &&
+			(cspi_ss == PIN_UNSET || cspi_so == PIN_UNSET ||
+			cspi_si == PIN_UNSET || cspi_sck == PIN_UNSET ||
+			cdone == PIN_UNSET || creset == PIN_UNSET)) {
+		fprintf(stderr, "%s (%s) isn't a Raspberry Pi gpio controller, "
+			"give the wiring with -p\n", chip, info.label);
+		spidevClose();
+		return -1;
+	}
+
+	if (debug)
+		printf("spidev: %s (%s), %u lines\n", chip, info.label, info.lines);
+
+	if (spi_khz == 0)
+		return 0;
+
+	// spidev copies each message through a buffer of this size
+	FILE *fp = fopen(SPIDEV_BUFSIZ_PATH, "r");
+	if (fp != NULL) {
+		if (fscanf(fp, "%u", &spidev_bufsiz) != 1 || spidev_bufsiz == 0)
+			spidev_bufsiz = SPIDEV_BUFSIZ;
+		fclose(fp);
+	}
+
+	// mode 3 like the bit banged clock; SS is a gpio, so keep the
+	// controller's chip select out of it if the driver can
+	uint32_t mode = SPI_MODE_3 | SPI_NO_CS;
+	uint8_t mode8 = SPI_MODE_3;
+	uint8_t bits = 8;
+	uint32_t hz = (spi_khz > 0 ? spi_khz : SPIDEV_KHZ) * 1000;
+
+	spidev_fd = open(dev, O_RDWR | O_CLOEXEC);
+	if (spidev_fd < 0 ||
+			(ioctl(spidev_fd, SPI_IOC_WR_MODE32, &mode) < 0 &&
+			ioctl(spidev_fd, SPI_IOC_WR_MODE, &mode8) < 0) ||
+			ioctl(spidev_fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0 ||
+			ioctl(spidev_fd, SPI_IOC_WR_MAX_SPEED_HZ, &hz) < 0) {
+		fprintf(stderr, "%s: %s, bit banging\n", dev, strerror(errno));
+		if (spidev_fd >= 0) close(spidev_fd);
+		spidev_fd = -1;
+		return 0;
+	}
+
+	spidev_zero = calloc(1, spidev_bufsiz);
+	spidev_drop = malloc(spidev_bufsiz);
+
+	if (debug)
+		printf("spidev: %s at %u kHz, %u bytes per message\n", dev,
+			hz / 1000, spidev_bufsiz);
+
+	return 0;
+
+}
+
+void spidevClose(void) {
+	for (int r = 0; r < spidev_nreqs; r++)
+		close(spidev_reqs[r].fd);
+	spidev_nreqs = 0;
+	memset(spidev_req_of, 0, sizeof(spidev_req_of));
+	if (spidev_fd >= 0) close(spidev_fd);
+	spidev_fd = -1;
+	if (spidev_chip >= 0) close(spidev_chip);
+	spidev_chip = -1;
+	free(spidev_zero);
+	free(spidev_drop);
+	spidev_zero = spidev_drop = NULL;
+}
+
+// SRAM loads drive SI and read SO, as MOSI and MISO of the controller do in
+// the default wiring; flash access has them the other way around and is bit
+// banged. once the data lines have been taken as gpios they stay that way
+
+int spidevSpiHw(void) {
+	return spidev_fd >= 0 && spi_swap && !spidev_req_of[cspi_sck];
+}
+
+// the clock and data lines belong to the controller while it's in use
+
+int spidevOwned(uint8_t pin) {
+	return spidevSpiHw() &&
+		(pin == cspi_sck || pin == cspi_so || pin == cspi_si);
+}
+
+// request a set of lines as they are; returns the request
+
+int spidevRequest(const uint8_t *pins, int n) {
+
+	struct gpio_v2_line_request req;
+
+	if (spidev_nreqs == SPIDEV_REQS) {
+		fprintf(stderr, "too many gpio line requests\n");
+		return -1;
+	}
+
+	memset(&req, 0, sizeof(req));
+	for (int i = 0; i < n; i++)
+		req.offsets[i] = pins[i];
+	req.num_lines = n;
+	snprintf(req.consumer, sizeof(req.consumer), "ldprog");
+
+	if (ioctl(spidev_chip, GPIO_V2_GET_LINE_IOCTL, &req) < 0) {
+		fprintf(stderr, "gpio line %i request error: %s\n", pins[0],
+			strerror(errno));
+		return -1;
+	}
+
+	int r = spidev_nreqs++;
+	spidev_reqs[r].fd = req.fd;
+	spidev_reqs[r].out = 0;
+	spidev_reqs[r].in = 0;
+	spidev_reqs[r].val = 0;
+	for (int i = 0; i < n; i++) {
+		spidev_req_of[pins[i]] = r + 1;
+		spidev_bit_of[pins[i]] = i;
+	}
+
+	return r;
+
+}
+
+// the request a line is in, made on first use: SS, CRESET and CDONE are
+// requested together, as are the clock and data lines, so that each group
+// can be set or read in one ioctl; any other pin gets a request of its own
+
+int spidevLine(uint8_t pin) {
+
+	uint8_t ctl[3] = { cspi_ss, creset, cdone };
+	uint8_t dat[3] = { cspi_sck, cspi_so, cspi_si };
+	uint8_t pins[3];
+	uint8_t *grp = NULL;
+	int n = 0;
+
+	if (spidev_req_of[pin])
+		return spidev_req_of[pin] - 1;
+
+	for (int i = 0; i < 3; i++) {
+		if (pin == ctl[i]) grp = ctl;
+		if (pin == dat[i]) grp = dat;
+	}
+
+	if (grp == NULL) {
+		pins[n++] = pin;
+	} else {
+		for (int i = 0; i < 3; i++) {
+			int dup = spidev_req_of[grp[i]] != 0;
+			for (int j = 0; j < n; j++)
+				if (pins[j] == grp[i]) dup = 1;
+			if (!dup) pins[n++] = grp[i];
+		}
+	}
+
+	return spidevRequest(pins, n);
+
+}
+
+// direction and output level of every line of a request, in one ioctl
+
+int spidevConfig(int r) {
+
+	struct gpio_v2_line_config cfg;
+	struct spidev_req *rq = &spidev_reqs[r];
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.num_attrs = 3;
+	cfg.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_FLAGS;
+	cfg.attrs[0].attr.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+	cfg.attrs[0].mask = rq->out;
+	cfg.attrs[1].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+	cfg.attrs[1].attr.values = rq->val;
+	cfg.attrs[1].mask = rq->out;
+	cfg.attrs[2].attr.id = GPIO_V2_LINE_ATTR_ID_FLAGS;
+	cfg.attrs[2].attr.flags = GPIO_V2_LINE_FLAG_INPUT;
+	cfg.attrs[2].mask = rq->in;
+
+	if (ioctl(rq->fd, GPIO_V2_LINE_SET_CONFIG_IOCTL, &cfg) < 0) {
+		fprintf(stderr, "gpio line config error: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+
+}
+
+void spidevSet(int r, uint64_t mask, uint64_t bits) {
+	struct gpio_v2_line_values v = { .bits = bits, .mask = mask };
+	if (ioctl(spidev_reqs[r].fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &v) < 0)
+		fprintf(stderr, "gpio set error: %s\n", strerror(errno));
+	spidev_reqs[r].val = (spidev_reqs[r].val & ~mask) | (bits & mask);
+}
+
+uint64_t spidevGet(int r, uint64_t mask) {
+	struct gpio_v2_line_values v = { .bits = 0, .mask = mask };
+	if (ioctl(spidev_reqs[r].fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &v) < 0)
+		fprintf(stderr, "gpio get error: %s\n", strerror(errno));
+	return v.bits & mask;
+}
+
+// values can only be set on outputs
+
+void spidevOutputs(int r, uint64_t mask) {
+	struct spidev_req *rq = &spidev_reqs[r];
+	if ((rq->out & mask) == mask) return;
+	rq->out |= mask;
+	rq->in &= ~mask;
+	spidevConfig(r);
+}
+
+void spidevSetMode(uint8_t pin, uint8_t dir) {
+
+	int r;
+
+	if (spidevOwned(pin) || (r = spidevLine(pin)) < 0) return;
+
+	struct spidev_req *rq = &spidev_reqs[r];
+	uint64_t bit = 1ULL << spidev_bit_of[pin];
+
+	if (dir == PI_OUTPUT) {
+		if (rq->out & bit) return;
+		rq->out |= bit;
+		rq->in &= ~bit;
+	} else {
+		if (rq->in & bit) return;
+		rq->in |= bit;
+		rq->out &= ~bit;
+	}
+
+	spidevConfig(r);
+
+}
+
+// like gpioWrite, writing to an input makes it an output
+
+void spidevWrite(uint8_t pin, uint8_t val) {
+
+	int r;
+
+	if (spidevOwned(pin) || (r = spidevLine(pin)) < 0) return;
+
+	struct spidev_req *rq = &spidev_reqs[r];
+	uint64_t bit = 1ULL << spidev_bit_of[pin];
+
+	if (rq->out & bit) {
+		spidevSet(r, bit, val ? bit : 0);
+	} else {
+		rq->val = (rq->val & ~bit) | (val ? bit : 0);
+		spidevOutputs(r, bit);
+	}
+
+}
+
+uint8_t spidevRead(uint8_t pin) {
+
+	int r;
+
+	if (spidevOwned(pin) || (r = spidevLine(pin)) < 0) return 0;
+
+	uint64_t bit = 1ULL << spidev_bit_of[pin];
+	return spidevGet(r, bit) ? 1 : 0;
+
+}
+
+// one read per request; the wiring's lines are requested first so that
+// they're included
+
+uint64_t spidevReadAll(void) {
+
+	uint64_t val = 0;
+
+	spidevLine(cspi_ss);
+	if (!spidevOwned(cspi_sck))
+		spidevLine(cspi_sck);
+
+	for (int r = 0; r < spidev_nreqs; r++) {
+		uint64_t bits = spidevGet(r, ~0ULL);
+		for (int pin = 0; pin < GPIO_MASK_PINS; pin++) {
+			if (spidev_req_of[pin] == r + 1 &&
+					(bits & (1ULL << spidev_bit_of[pin])))
+				val |= PIN(pin);
+		}
+	}
+
+	return val;
+
+}
+
+// spidev if the wiring allows, else bit banging; each message is at most
+// the spidev buffer size (the bufsiz module parameter, raise it for fewer
+// ioctls). bit banged bits are two bulk sets (clock low with the data,
+// then clock high), reads sample the input with a bulk get
+
+void spidevSpiWrite(const uint8_t *buf, uint32_t len) {
+
+	struct spi_ioc_transfer xfer;
+
+	if (spidevSpiHw()) {
+		while (len) {
+			uint32_t n = len > spidev_bufsiz ? spidev_bufsiz : len;
+			memset(&xfer, 0, sizeof(xfer));
+			xfer.tx_buf = (uintptr_t)(buf != NULL ? buf : spidev_zero);
+			xfer.len = n;
+			if (ioctl(spidev_fd, SPI_IOC_MESSAGE(1), &xfer) < 0)
+				fprintf(stderr, "spidev write error: %s\n", strerror(errno));
+			if (buf != NULL) buf += n;
+			len -= n;
+		}
+		return;
+	}
+
+	int r = spidevLine(cspi_sck);
+	if (r < 0) return;
+
+	uint64_t sck = 1ULL << spidev_bit_of[cspi_sck];
+	uint64_t data = 1ULL << spidev_bit_of[spi_swap ? cspi_si : cspi_so];
+	uint8_t data_byte = 0x00;
+
+	spidevOutputs(r, sck | data);
+
+	for (int p = 0; p < len; p++) {
+
+		if (debug)
+			printf(" spi writing byte %i / %i\n", p, len);
+
+		if (buf != NULL)
+			data_byte = buf[p];
+
+		for (int bit = 7; bit >= 0; bit--) {
+			spidevSet(r, sck | data, ((data_byte >> bit) & 1) ? data : 0);
+			spidevSet(r, sck, sck);
+		}
+
+	}
+
+}
+
+void spidevSpiRead(uint8_t *buf, uint32_t len) {
+
+	struct spi_ioc_transfer xfer;
+
+	if (spidevSpiHw()) {
+		while (len) {
+			uint32_t n = len > spidev_bufsiz ? spidev_bufsiz : len;
+			memset(&xfer, 0, sizeof(xfer));
+			xfer.rx_buf = (uintptr_t)(buf != NULL ? buf : spidev_drop);
+			xfer.len = n;
+			if (ioctl(spidev_fd, SPI_IOC_MESSAGE(1), &xfer) < 0)
+				fprintf(stderr, "spidev read error: %s\n", strerror(errno));
+			if (buf != NULL) buf += n;
+			len -= n;
+		}
+		return;
+	}
+
+	int r = spidevLine(cspi_sck);
+	if (r < 0) return;
+
+	uint64_t sck = 1ULL << spidev_bit_of[cspi_sck];
+	uint64_t in = 1ULL << spidev_bit_of[spi_swap ? cspi_so : cspi_si];
+
+	spidevOutputs(r, sck);
+
+	for (int p = 0; p < len; p++) {
+
+		uint8_t data_byte = 0x00;
+
+		for (int bit = 7; bit >= 0; bit--) {
+			spidevSet(r, sck, 0);
+			spidevSet(r, sck, sck);
+			if (spidevGet(r, in))
+				data_byte |= 1 << bit;
+		}
+
+		if (buf != NULL)
+			buf[p] = data_byte;
+
+	}
+
+}
+
+#endif
@@ -0,0 +1,685 @@
+/*
+ * Lone Dynamics Device Programmer - simulated Müsli interface device
+ * Copyright (c) 2021 Lone Dynamics Corporation. All rights reserved.
+ *
+ * Drop-in replacement for hidapi.c that emulates the Müsli HID firmware
+ * together with a SPI NOR flash and an FPGA SPI configuration port, so that
+ * ldprog can be exercised without hardware:
+ *
+ *   make musli_sim
+ *   MUSLI_SIM_FLASH=flash.bin ./ldprog_sim -f image.bin
+ *
+ * Environment:
+ *
+ *   MUSLI_SIM_FLASH	file backing the flash contents (default: none)
+ *   MUSLI_SIM_PINS	<ss>,<creset>,<cdone> (default: 4,3,2)
+ *   MUSLI_SIM_LEGACY	behave like firmware without capability support
+ *   MUSLI_SIM_STATS	print report and SPI byte counts on exit
+ *   MUSLI_SIM_SERIAL	serial number (default: 0000; path: "sim")
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <wchar.h>
+
+#include "hidapi.h"
+
+#define MUSLI_CMD_READY 0x00
+#define MUSLI_CMD_INIT 0x01
+#define MUSLI_CMD_SYNC 0x02
+#define MUSLI_CMD_GPIO_SET_DIR 0x10
+#define MUSLI_CMD_GPIO_DISABLE_PULLS 0x11
+#define MUSLI_CMD_GPIO_PULL_UP 0x12
+#define MUSLI_CMD_GPIO_PULL_DOWN 0x13
+#define MUSLI_CMD_GPIO_GET 0x20
+#define MUSLI_CMD_GPIO_PUT 0x21
+#define MUSLI_CMD_GPIO_SET_MASK 0x22
+#define MUSLI_CMD_GPIO_GET_ALL 0x23
+#define MUSLI_CMD_SPI_READ 0x80
+#define MUSLI_CMD_SPI_WRITE 0x81
+#define MUSLI_CMD_SPI_XFER 0x82
+#define MUSLI_CMD_CFG_SPI_CLK 0x8e
+#define MUSLI_CMD_CFG_PIO_SPI 0x8f
+#define MUSLI_CMD_BUF_WRITE 0xa0
+#define MUSLI_CMD_FLASH_PROG_SECTOR 0xa1
+#define MUSLI_CMD_FLASH_CRC32 0xa2
+#define MUSLI_CMD_FLASH_WAIT 0xa3
+#define MUSLI_CMD_RESET 0xf0
+
+#define MUSLI_CAP_PROG_SECTOR	(1 << 0)
+#define MUSLI_CAP_CRC32			(1 << 1)
+#define MUSLI_CAP_FLASH_WAIT		(1 << 2)
+#define MUSLI_CAP_GPIO_MASK		(1 << 3)
+#define MUSLI_CAP_SPI_XFER		(1 << 4)
+#define MUSLI_CAP_HID_STREAM		(1 << 5)
+#define MUSLI_CAP_HID_SYNC		(1 << 6)
+
+#define MUSLI_XFER_PIN 0x1f
+#define MUSLI_XFER_HOLD 0x20
+#define MUSLI_XFER_CONT 0x40
+#define MUSLI_XFER_SS_HIGH 0x80
+
+#define SIM_REPORT_SIZE 255
+#define SIM_MAX_PAYLOAD 249
+#define SIM_MAX_REPLY 253
+#define SIM_CAPS (MUSLI_CAP_PROG_SECTOR | MUSLI_CAP_CRC32 | MUSLI_CAP_FLASH_WAIT | \
+	MUSLI_CAP_GPIO_MASK | MUSLI_CAP_SPI_XFER | MUSLI_CAP_HID_STREAM | \
+	MUSLI_CAP_HID_SYNC)
+
+// error codes reported by SYNC
+#define SIM_ERR_CMD 0x01		// unknown command
+#define SIM_ERR_LEN 0x02		// payload too long
+#define SIM_INPUT_REPORTS 32
+#define SIM_PATH "sim"
+
+#define FLASH_SIZE (16 * 1024 * 1024)
+#define FLASH_ID { 0xef, 0x40, 0x18, 0x00, 0x00 }
+
+// simulated busy times (us), shortened from typical datasheet values
+#define FLASH_T_PP 200
+#define FLASH_T_SE 2000
+#define FLASH_T_CE 50000
+
+struct hid_device_ {
+	int open;
+};
+
+static struct hid_device_ sim_dev;
+
+static int sim_ss = 4;
+static int sim_creset = 3;
+static int sim_cdone = 2;
+static int sim_legacy = 0;
+
+static uint8_t pins[32];
+static uint8_t reply[SIM_REPORT_SIZE];
+
+// queued input reports (stream mode)
+static uint8_t input[SIM_INPUT_REPORTS][SIM_REPORT_SIZE];
+static int input_head = 0;
+static int input_count = 0;
+
+// fpga
+static int cfg_mode = 0;
+static uint32_t cfg_bytes = 0;
+static int cdone = 0;
+
+// flash
+static uint8_t *flash;
+static const char *flash_file = NULL;
+static int flash_dirty = 0;
+static int flash_wel = 0;
+static uint64_t flash_busy_until = 0;
+static uint8_t frame[8];
+static uint32_t frame_pos = 0;
+static uint32_t flash_addr = 0;
+static uint8_t page[256];
+static int page_used = 0;
+
+// device-side sector buffer
+static uint8_t sector[4096];
+static uint32_t sector_len = 0;
+
+// failed commands since the last SYNC, and the first of them
+static uint8_t sim_seq = 0;
+static int sync_errors = 0;
+static uint8_t sync_seq, sync_cmd, sync_code;
+
+// stats
+static unsigned long st_reports = 0;
+static unsigned long st_spi_bytes = 0;
+
+static uint64_t sim_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int flash_busy(void) {
+	return sim_now() < flash_busy_until;
+}
+
+static uint8_t flash_status(void) {
+	return (flash_busy() ? 0x01 : 0x00) | (flash_wel ? 0x02 : 0x00);
+}
+
+static uint32_t crc32(const uint8_t *buf, uint32_t len) {
+	uint32_t crc = 0xffffffff;
+	for (uint32_t i = 0; i < len; i++) {
+		crc ^= buf[i];
+		for (int b = 0; b < 8; b++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+// --
+// flash primitives (also used by the device-side commands)
+// --
+
+static void flash_erase(uint32_t addr, uint32_t len, uint32_t t) {
+	memset(flash + (addr % FLASH_SIZE), 0xff, len);
+	flash_dirty = 1;
+	flash_wel = 0;
+	flash_busy_until = sim_now() + t;
+}
+
+static void flash_program(uint32_t addr, const uint8_t *buf, uint32_t len) {
+	uint32_t base = addr & ~0xff;
+	for (uint32_t i = 0; i < len; i++)
+		flash[(base + ((addr + i) & 0xff)) % FLASH_SIZE] &= buf[i];
+	flash_dirty = 1;
+	flash_wel = 0;
+	flash_busy_until = sim_now() + FLASH_T_PP;
+}
+
+static void flash_wait(void) {
+	uint64_t now = sim_now();
+	if (now < flash_busy_until)
+		usleep(flash_busy_until - now);
+}
+
+// --
+// SPI bus
+// --
+
+static void spi_select(int active) {
+
+	if (active) {
+		frame_pos = 0;
+		page_used = 0;
+		return;
+	}
+
+	// commands take effect when SS is released
+	if (frame_pos == 0 || flash_busy()) return;
+
+	switch (frame[0]) {
+		case 0x06:
+			flash_wel = 1;
+			break;
+		case 0x02:
+			if (flash_wel && frame_pos >= 4)
+				flash_program(flash_addr, page, page_used);
+			break;
+		case 0x20:
+			if (flash_wel && frame_pos >= 4)
+				flash_erase(flash_addr & ~0xfff, 4096, FLASH_T_SE);
+			break;
+		case 0x60:
+		case 0xc7:
+			if (flash_wel)
+				flash_erase(0, FLASH_SIZE, FLASH_T_CE);
+			break;
+		case 0x98:
+			flash_wel = 0;
+			break;
+	}
+
+	frame_pos = 0;
+
+}
+
+static uint8_t spi_byte(uint8_t mosi) {
+
+	const uint8_t id[] = FLASH_ID;
+	uint8_t miso = 0xff;
+	uint32_t pos = frame_pos;
+
+	st_spi_bytes++;
+
+	if (cfg_mode) {
+		cfg_bytes++;
+		return miso;
+	}
+
+	if (pins[sim_ss]) return miso;
+
+	if (pos < sizeof(frame))
+		frame[pos] = mosi;
+	frame_pos++;
+
+	if (pos == 0) return miso;
+
+	// only status reads are answered while the flash is busy
+	if (flash_busy() && frame[0] != 0x05) return miso;
+
+	switch (frame[0]) {
+		case 0x05:
+			miso = flash_status();
+			break;
+		case 0x9f:
+			if (pos <= sizeof(id)) miso = id[pos - 1];
+			break;
+		case 0xab:
+			miso = 0x17;
+			break;
+		case 0x03:
+		case 0x02:
+		case 0x20:
+			if (pos <= 3) {
+				flash_addr = (flash_addr << 8) | mosi;
+				if (pos == 3) flash_addr &= 0xffffff;
+			} else if (frame[0] == 0x03) {
+				miso = flash[flash_addr++ % FLASH_SIZE];
+			} else if (frame[0] == 0x02) {
+				if (page_used < sizeof(page))
+					page[page_used++] = mosi;
+			}
+			break;
+	}
+
+	return miso;
+
+}
+
+static void gpio_put(uint8_t pin, uint8_t val) {
+
+	if (pin >= sizeof(pins)) return;
+
+	uint8_t old = pins[pin];
+	pins[pin] = val;
+
+	if (pin == sim_creset) {
+		if (!val) {
+			// reset asserted; fpga unconfigured
+			cdone = 0;
+			cfg_mode = 0;
+		} else if (!old && !pins[sim_ss]) {
+			// released with SS low: SPI slave configuration mode
+			cfg_mode = 1;
+			cfg_bytes = 0;
+		}
+	}
+
+	if (pin == sim_ss && old != val) {
+		if (cfg_mode && val && cfg_bytes > 1) {
+			// configuration data followed by SS release
+			cdone = 1;
+			cfg_mode = 0;
+		} else if (!cfg_mode) {
+			spi_select(!val);
+		}
+	}
+
+}
+
+// --
+// device-side commands
+// --
+
+static void prog_sector(uint32_t addr) {
+
+	uint8_t status = 0x00;
+	uint32_t crc;
+
+	addr &= ~0xfff;
+
+	if (sector_len != sizeof(sector)) {
+		status = 0x01;
+	} else {
+		flash_erase(addr, sizeof(sector), FLASH_T_SE);
+		flash_wait();
+		for (uint32_t p = 0; p < sizeof(sector); p += 256) {
+			flash_program(addr + p, sector + p, 256);
+			flash_wait();
+		}
+	}
+
+	crc = crc32(flash + addr, sizeof(sector));
+
+	reply[0] = status;
+	reply[1] = crc;
+	reply[2] = crc >> 8;
+	reply[3] = crc >> 16;
+	reply[4] = crc >> 24;
+
+	sector_len = 0;
+
+}
+
+static void flash_crc(uint32_t addr, uint32_t len) {
+
+	uint32_t crc = 0;
+	uint8_t status = 0x00;
+
+	if (addr + len > FLASH_SIZE || flash_busy())
+		status = 0x01;
+	else
+		crc = crc32(flash + addr, len);
+
+	st_spi_bytes += len + 4;
+
+	reply[0] = status;
+	reply[1] = crc;
+	reply[2] = crc >> 8;
+	reply[3] = crc >> 16;
+	reply[4] = crc >> 24;
+
+}
+
+static void wait_ready(uint8_t mask, uint32_t timeout) {
+
+	uint64_t start = sim_now();
+	uint64_t deadline = start + (uint64_t)timeout * 1000;
+	uint8_t status;
+
+	while (((status = flash_status()) & mask) && sim_now() < deadline) {
+		st_spi_bytes += 2;
+		usleep(10);
+	}
+
+	uint32_t elapsed = sim_now() - start;
+
+	reply[0] = status;
+	reply[1] = (status & mask) ? 1 : 0;
+	reply[2] = elapsed;
+	reply[3] = elapsed >> 8;
+	reply[4] = elapsed >> 16;
+	reply[5] = elapsed >> 24;
+
+}
+
+static void sim_fail(uint8_t cmd, uint8_t code) {
+	if (sim_legacy) return;
+	if (!sync_errors++) {
+		sync_seq = sim_seq;
+		sync_cmd = cmd;
+		sync_code = code;
+	}
+}
+
+static void musli_cmd(const uint8_t *buf) {
+
+	uint8_t cmd = buf[0];
+	uint8_t len = buf[1];
+	const uint8_t *data = buf + 4;
+
+	bzero(reply, sizeof(reply));
+
+	switch (cmd) {
+		case MUSLI_CMD_READY:
+			if (sim_legacy) break;
+			reply[0] = 'M';
+			reply[1] = 'U';
+			reply[2] = 1;
+			reply[3] = SIM_MAX_PAYLOAD;
+			reply[4] = 0xff;
+			reply[5] = SIM_CAPS;
+			reply[6] = SIM_CAPS >> 8;
+			reply[7] = SIM_CAPS >> 16;
+			reply[8] = SIM_CAPS >> 24;
+			reply[9] = SIM_MAX_REPLY;
+			break;
+		case MUSLI_CMD_SYNC:
+			if (sim_legacy) break;
+			reply[0] = sync_errors > 255 ? 255 : sync_errors;
+			reply[1] = sync_seq;
+			reply[2] = sync_cmd;
+			reply[3] = sync_code;
+			sync_errors = 0;
+			break;
+		case MUSLI_CMD_INIT:
+		case MUSLI_CMD_GPIO_SET_DIR:
+		case MUSLI_CMD_GPIO_DISABLE_PULLS:
+		case MUSLI_CMD_GPIO_PULL_UP:
+		case MUSLI_CMD_GPIO_PULL_DOWN:
+		case MUSLI_CMD_CFG_SPI_CLK:
+		case MUSLI_CMD_CFG_PIO_SPI:
+		case MUSLI_CMD_RESET:
+			// not simulated
+			break;
+		case MUSLI_CMD_GPIO_PUT:
+			gpio_put(buf[1], buf[2]);
+			break;
+		case MUSLI_CMD_GPIO_GET:
+			if (buf[1] == sim_cdone)
+				reply[0] = cdone;
+			else if (buf[1] < sizeof(pins))
+				reply[0] = pins[buf[1]];
+			break;
+		case MUSLI_CMD_GPIO_SET_MASK: {
+			if (sim_legacy) break;
+			// directions are not simulated; outputs in pin order
+			uint32_t mask = data[8] | (data[9] << 8) | (data[10] << 16) |
+				((uint32_t)data[11] << 24);
+			uint32_t out = data[12] | (data[13] << 8) | (data[14] << 16) |
+				((uint32_t)data[15] << 24);
+			for (int pin = 0; pin < 32; pin++) {
+				if (mask & (1UL << pin))
+					gpio_put(pin, (out >> pin) & 1);
+			}
+			break;
+		}
+		case MUSLI_CMD_GPIO_GET_ALL: {
+			if (sim_legacy) break;
+			uint32_t val = 0;
+			for (int pin = 0; pin < 32 && pin < sizeof(pins); pin++) {
+				if (pin == sim_cdone ? cdone : pins[pin])
+					val |= 1UL << pin;
+			}
+			reply[0] = val;
+			reply[1] = val >> 8;
+			reply[2] = val >> 16;
+			reply[3] = val >> 24;
+			break;
+		}
+		case MUSLI_CMD_SPI_WRITE:
+			if (len > SIM_MAX_PAYLOAD) {
+				sim_fail(cmd, SIM_ERR_LEN);
+				len = SIM_MAX_PAYLOAD;
+			}
+			for (int i = 0; i < len; i++)
+				spi_byte(data[i]);
+			break;
+		case MUSLI_CMD_SPI_XFER: {
+			if (sim_legacy) break;
+			uint8_t ss = buf[3] & MUSLI_XFER_PIN;
+			uint8_t active = (buf[3] & MUSLI_XFER_SS_HIGH) ? 1 : 0;
+			uint8_t rlen = buf[2];
+			if (len > SIM_MAX_PAYLOAD) len = SIM_MAX_PAYLOAD;
+			if (rlen > SIM_MAX_REPLY) rlen = SIM_MAX_REPLY;
+			if (!(buf[3] & MUSLI_XFER_CONT))
+				gpio_put(ss, active);
+			for (int i = 0; i < len; i++)
+				spi_byte(data[i]);
+			for (int i = 0; i < rlen; i++)
+				reply[i] = spi_byte(0x00);
+			if (!(buf[3] & MUSLI_XFER_HOLD))
+				gpio_put(ss, !active);
+			break;
+		}
+		case MUSLI_CMD_SPI_READ:
+			if (len > (sim_legacy ? SIM_MAX_PAYLOAD : SIM_MAX_REPLY))
+				len = sim_legacy ? SIM_MAX_PAYLOAD : SIM_MAX_REPLY;
+			for (int i = 0; i < len; i++)
+				reply[i] = spi_byte(0x00);
+			break;
+		case MUSLI_CMD_BUF_WRITE:
+			if (sim_legacy) break;
+			for (int i = 0; i < len && sector_len < sizeof(sector); i++)
+				sector[sector_len++] = data[i];
+			break;
+		case MUSLI_CMD_FLASH_PROG_SECTOR:
+			if (sim_legacy) break;
+			prog_sector((buf[1] << 16) | (buf[2] << 8) | buf[3]);
+			break;
+		case MUSLI_CMD_FLASH_WAIT:
+			if (sim_legacy) break;
+			wait_ready(buf[1], buf[2] | (buf[3] << 8));
+			break;
+		case MUSLI_CMD_FLASH_CRC32:
+			if (sim_legacy) break;
+			flash_crc((buf[1] << 16) | (buf[2] << 8) | buf[3],
+				data[0] | (data[1] << 8) | (data[2] << 16) | (data[3] << 24));
+			break;
+		default:
+			sim_fail(cmd, SIM_ERR_CMD);
+			break;
+	}
+
+}
+
+// --
+// setup
+// --
+
+static void sim_exit(void) {
+
+	if (flash_file && flash_dirty) {
+		FILE *fp = fopen(flash_file, "w");
+		if (fp) {
+			fwrite(flash, 1, FLASH_SIZE, fp);
+			fclose(fp);
+		}
+	}
+
+	if (getenv("MUSLI_SIM_STATS"))
+		fprintf(stderr, "musli_sim: %lu reports, %lu spi bytes\n",
+			st_reports, st_spi_bytes);
+
+}
+
+static void sim_init(void) {
+
+	const char *s;
+
+	flash = malloc(FLASH_SIZE);
+	memset(flash, 0xff, FLASH_SIZE);
+
+	flash_file = getenv("MUSLI_SIM_FLASH");
+	if (flash_file) {
+		FILE *fp = fopen(flash_file, "r");
+		if (fp) {
+			fread(flash, 1, FLASH_SIZE, fp);
+			fclose(fp);
+		}
+	}
+
+	if ((s = getenv("MUSLI_SIM_PINS")))
+		sscanf(s, "%i,%i,%i", &sim_ss, &sim_creset, &sim_cdone);
+
+	sim_legacy = getenv("MUSLI_SIM_LEGACY") != NULL;
+
+	pins[sim_ss] = 1;
+	pins[sim_creset] = 1;
+
+	atexit(sim_exit);
+
+}
+
+// --
+// hidapi
+// --
+
+static wchar_t *sim_serial(void) {
+	static wchar_t serial[64];
+	const char *s = getenv("MUSLI_SIM_SERIAL");
+	if (s == NULL) s = "0000";
+	mbstowcs(serial, s, 63);
+	return serial;
+}
+
+struct hid_device_info HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
+		unsigned short product_id) {
+	struct hid_device_info *d = calloc(1, sizeof(struct hid_device_info));
+	d->path = strdup(SIM_PATH);
+	d->vendor_id = vendor_id;
+	d->product_id = product_id;
+	d->serial_number = wcsdup(sim_serial());
+	d->interface_number = -1;
+	return d;
+}
+
+void HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs) {
+	while (devs != NULL) {
+		struct hid_device_info *next = devs->next;
+		free(devs->path);
+		free(devs->serial_number);
+		free(devs);
+		devs = next;
+	}
+}
+
+hid_device * HID_API_EXPORT hid_open_path(const char *path) {
+	if (strcmp(path, SIM_PATH)) return NULL;
+	if (!sim_dev.open) {
+		sim_init();
+		sim_dev.open = 1;
+	}
+	return &sim_dev;
+}
+
+hid_device * HID_API_EXPORT hid_open(unsigned short vendor_id,
+		unsigned short product_id, const wchar_t *serial_number) {
+	if (serial_number != NULL && wcscmp(serial_number, sim_serial()))
+		return NULL;
+	return hid_open_path(SIM_PATH);
+}
+
+int HID_API_EXPORT_CALL hid_get_serial_number_string(hid_device *dev,
+		wchar_t *string, size_t maxlen) {
+	if (maxlen == 0) return -1;
+	wcsncpy(string, sim_serial(), maxlen - 1);
+	string[maxlen - 1] = 0;
+	return 0;
+}
+
+void HID_API_EXPORT hid_close(hid_device *dev) {
+}
+
+int HID_API_EXPORT hid_send_feature_report(hid_device *dev,
+		const unsigned char *data, size_t length) {
+	if (length < 6 || data[0] != 0xaa) return -1;
+	st_reports++;
+	sim_seq = data[1] >> 1;
+	musli_cmd(data + 2);
+	return length;
+}
+
+int HID_API_EXPORT hid_get_feature_report(hid_device *dev,
+		unsigned char *data, size_t length) {
+	if (length < 2) return -1;
+	st_reports++;
+	data[0] = 0xaa;
+	data[1] = 0x01;
+	memcpy(data + 2, reply, length - 2 < sizeof(reply) ? length - 2 :
+		sizeof(reply));
+	return length;
+}
+
+// stream mode: output reports are processed in order and, when the request
+// asks for it (status byte 0x01), answered with an input report
+
+int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data,
+		size_t length) {
+	if (length < 6 || data[0] != 0xaa) return -1;
+	st_reports++;
+	sim_seq = data[1] >> 1;
+	musli_cmd(data + 2);
+	if (data[1] & 0x01) {
+		if (input_count == SIM_INPUT_REPORTS) return -1;
+		uint8_t *r = input[(input_head + input_count) % SIM_INPUT_REPORTS];
+		r[0] = 0xaa;
+		r[1] = 0x01;
+		memcpy(r + 2, reply, SIM_REPORT_SIZE - 2);
+		input_count++;
+	}
+	return length;
+}
+
+int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data,
+		size_t length, int milliseconds) {
+	if (!input_count) return 0;
+	st_reports++;
+	if (length > SIM_REPORT_SIZE) length = SIM_REPORT_SIZE;
+	memcpy(data, input[input_head], length);
+	input_head = (input_head + 1) % SIM_INPUT_REPORTS;
+	input_count--;
+	return length;
+}
@@ -0,0 +1,312 @@
+/*
+ * Lone Dynamics Device Programmer - simulated Raspberry Pi GPIO
+ * Copyright (c) 2021 Lone Dynamics Corporation. All rights reserved.
+ *
+ * Stands in for libpigpio: the GPIO level register, the SPI0 controller and
+ * DMA waveforms are emulated in memory, together with an FPGA configuration
+ * port that takes SI on each rising SCK while SS is low, so that the bit
+ * banging loops can be timed and their output compared:
+ *
+ *   make musli_gpio_sim
+ *   PIGPIO_SIM_CAP=cap.bin ./ldprog_gpio_sim -F 0 -s image.bin
+ *   cmp cap.bin image.bin
+ *
+ * The flash isn't simulated, its output reads as 0.
+ *
+ * Environment:
+ *
+ *   PIGPIO_SIM_CAP	file the bytes of the last configuration are written to
+ *   PIGPIO_SIM_PINS	<ss>,<sck>,<si>,<cdone>,<creset> (default: 25,11,10,24,23)
+ *   PIGPIO_SIM_NOSPI	fail spiOpen, as without the SPI0 overlay
+ *   PIGPIO_SIM_STATS	print call, byte and waveform counts on exit
+ *   PIGPIO_SIM_BENCH	only keep the level register in the set/clear calls,
+ *			for timing the loops themselves (nothing is configured)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "pigpio_sim.h"
+
+#define SIM_GPIOS 54
+#define SIM_WAVES 64
+
+static int sim_ss = 25;
+static int sim_sck = 11;
+static int sim_si = 10;
+static int sim_cdone = 24;
+static int sim_creset = 23;
+static int sim_bench = 0;
+
+static uint32_t level = 0;
+static uint8_t modes[SIM_GPIOS];
+
+// fpga
+static uint8_t *cfg = NULL;
+static uint32_t cfg_len = 0;
+static uint32_t cfg_size = 0;
+static uint8_t cfg_byte = 0;
+static int cfg_bits = 0;
+static int cdone = 0;
+
+// waveforms
+static gpioPulse_t pending[PI_WAVE_MAX_PULSES];
+static unsigned pending_len = 0;
+static gpioPulse_t *waves[SIM_WAVES];
+static unsigned wave_len[SIM_WAVES];
+static unsigned wave_pulses = 0;
+
+// stats
+static unsigned long st_calls = 0;
+static unsigned long st_spi_bytes = 0;
+static unsigned long st_waves = 0;
+static uint64_t st_wave_us = 0;
+
+static void sim_cfg_byte(uint8_t b) {
+	if (cfg_len == cfg_size) {
+		cfg_size = cfg_size ? cfg_size * 2 : 65536;
+		cfg = realloc(cfg, cfg_size);
+	}
+	cfg[cfg_len++] = b;
+}
+
+// the fpga follows every change of the level register
+
+static void sim_level(uint32_t next) {
+
+	uint32_t prev = level;
+	level = next;
+
+	if (!(level & (1 << sim_creset))) {
+		cfg_len = 0;
+		cfg_bits = 0;
+		cdone = 0;
+		return;
+	}
+
+	if (level & (1 << sim_ss)) {
+		// a configuration ends when SS goes back up
+		if (!(prev & (1 << sim_ss)) && cfg_len)
+			cdone = 1;
+		return;
+	}
+
+	// and starts, byte aligned, when it goes down (the real port syncs on
+	// the bitstream's preamble instead, which covers stray clocks after
+	// the reset)
+	if (prev & (1 << sim_ss)) {
+		cfg_len = 0;
+		cfg_bits = 0;
+	}
+
+	if (!(prev & (1 << sim_sck)) && (level & (1 << sim_sck))) {
+		cfg_byte = (cfg_byte << 1) | ((level >> sim_si) & 1);
+		if (++cfg_bits == 8) {
+			sim_cfg_byte(cfg_byte);
+			cfg_bits = 0;
+		}
+	}
+
+}
+
+static uint32_t sim_read(void) {
+	return (level & ~(1 << sim_cdone)) | (cdone << sim_cdone);
+}
+
+static void sim_exit(void) {
+
+	const char *file = getenv("PIGPIO_SIM_CAP");
+
+	if (file) {
+		FILE *fp = fopen(file, "w");
+		if (fp) {
+			fwrite(cfg, 1, cfg_len, fp);
+			fclose(fp);
+		}
+	}
+
+	if (getenv("PIGPIO_SIM_STATS"))
+		fprintf(stderr, "pigpio_sim: %lu gpio calls, %lu spi bytes, "
+			"%lu waves (%llu us of clock), %u bytes configured, cdone %i\n",
+			st_calls, st_spi_bytes, st_waves, (unsigned long long)st_wave_us,
+			cfg_len, cdone);
+
+}
+
+// --
+// gpio
+// --
+
+int gpioInitialise(void) {
+
+	const char *s;
+
+	if ((s = getenv("PIGPIO_SIM_PINS")))
+		sscanf(s, "%i,%i,%i,%i,%i", &sim_ss, &sim_sck, &sim_si, &sim_cdone,
+			&sim_creset);
+
+	sim_bench = getenv("PIGPIO_SIM_BENCH") != NULL;
+
+	level = (1 << sim_ss) | (1 << sim_creset);
+	atexit(sim_exit);
+
+	return 0;
+
+}
+
+void gpioTerminate(void) {
+}
+
+int gpioSetMode(unsigned gpio, unsigned mode) {
+	if (gpio >= SIM_GPIOS) return -3;
+	modes[gpio] = mode;
+	return 0;
+}
+
+int gpioRead(unsigned gpio) {
+	st_calls++;
+	if (gpio >= 32) return 0;
+	return (sim_read() >> gpio) & 1;
+}
+
+// like pigpio, writing to a pin makes it an output
+
+int gpioWrite(unsigned gpio, unsigned level_) {
+	st_calls++;
+	if (gpio >= 32) return 0;
+	modes[gpio] = PI_OUTPUT;
+	sim_level(level_ ? level | (1 << gpio) : level & ~(1 << gpio));
+	return 0;
+}
+
+uint32_t gpioRead_Bits_0_31(void) {
+	st_calls++;
+	return sim_read();
+}
+
+int gpioWrite_Bits_0_31_Clear(uint32_t bits) {
+	st_calls++;
+	if (sim_bench)
+		level = level & ~bits;
+	else
+		sim_level(level & ~bits);
+	return 0;
+}
+
+int gpioWrite_Bits_0_31_Set(uint32_t bits) {
+	st_calls++;
+	if (sim_bench)
+		level = level | bits;
+	else
+		sim_level(level | bits);
+	return 0;
+}
+
+uint32_t gpioDelay(uint32_t micros) {
+	return micros;
+}
+
+// --
+// spi
+// --
+
+int spiOpen(unsigned spiChan, unsigned baud, unsigned spiFlags) {
+	if (getenv("PIGPIO_SIM_NOSPI")) return -76;	// PI_SPI_OPEN_FAILED
+	return 0;
+}
+
+int spiClose(unsigned handle) {
+	return 0;
+}
+
+int spiRead(unsigned handle, char *buf, unsigned count) {
+	memset(buf, 0, count);
+	st_spi_bytes += count;
+	return count;
+}
+
+int spiWrite(unsigned handle, char *buf, unsigned count) {
+	if ((level & (1 << sim_creset)) && !(level & (1 << sim_ss))) {
+		for (unsigned i = 0; i < count; i++)
+			sim_cfg_byte(buf[i]);
+	}
+	st_spi_bytes += count;
+	return count;
+}
+
+// --
+// waveforms: sent at once, so there's never one on air; the pulses of the
+// waves not deleted are limited like pigpio's
+// --
+
+int gpioWaveClear(void) {
+	for (int i = 0; i < SIM_WAVES; i++) {
+		free(waves[i]);
+		waves[i] = NULL;
+	}
+	wave_pulses = 0;
+	return 0;
+}
+
+int gpioWaveAddNew(void) {
+	pending_len = 0;
+	return 0;
+}
+
+int gpioWaveAddGeneric(unsigned numPulses, gpioPulse_t *pulses) {
+	if (pending_len + numPulses > PI_WAVE_MAX_PULSES) return -36;
+	memcpy(pending + pending_len, pulses, numPulses * sizeof(gpioPulse_t));
+	pending_len += numPulses;
+	return pending_len;
+}
+
+int gpioWaveCreate(void) {
+
+	int id;
+
+	if (wave_pulses + pending_len > PI_WAVE_MAX_PULSES) return -67;
+	for (id = 0; id < SIM_WAVES && waves[id] != NULL; id++);
+	if (id == SIM_WAVES) return -67;
+
+	waves[id] = malloc(pending_len * sizeof(gpioPulse_t));
+	memcpy(waves[id], pending, pending_len * sizeof(gpioPulse_t));
+	wave_len[id] = pending_len;
+	wave_pulses += pending_len;
+	pending_len = 0;
+
+	return id;
+
+}
+
+int gpioWaveDelete(unsigned wave_id) {
+	if (wave_id >= SIM_WAVES || waves[wave_id] == NULL) return -66;
+	wave_pulses -= wave_len[wave_id];
+	free(waves[wave_id]);
+	waves[wave_id] = NULL;
+	return 0;
+}
+
+int gpioWaveTxSend(unsigned wave_id, unsigned wave_mode) {
+
+	if (wave_id >= SIM_WAVES || waves[wave_id] == NULL) return -66;
+
+	for (unsigned i = 0; i < wave_len[wave_id]; i++) {
+		gpioPulse_t *p = &waves[wave_id][i];
+		sim_level((level | p->gpioOn) & ~p->gpioOff);
+		st_wave_us += p->usDelay;
+	}
+	st_waves++;
+
+	return 0;
+
+}
+
+int gpioWaveTxAt(void) {
+	return PI_NO_TX_WAVE;
+}
+
+int gpioWaveTxBusy(void) {
+	return 0;
+}
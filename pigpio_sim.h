@@ -0,0 +1,56 @@
+/*
+ * Lone Dynamics Device Programmer - simulated pigpio interface
+ * Copyright (c) 2021 Lone Dynamics Corporation. All rights reserved.
+ *
+ * The part of the pigpio C interface that ldprog uses, as implemented by
+ * pigpio_sim.c; included instead of <pigpio.h> when PIGPIO_SIM is defined.
+ */
+
+#ifndef PIGPIO_SIM_H
+#define PIGPIO_SIM_H
+
+#include <stdint.h>
+
+#define PI_INPUT 0
+#define PI_OUTPUT 1
+#define PI_ALT0 4
+
+#define PI_WAVE_MODE_ONE_SHOT 0
+#define PI_WAVE_MODE_REPEAT 1
+#define PI_WAVE_MODE_ONE_SHOT_SYNC 2
+#define PI_WAVE_MODE_REPEAT_SYNC 3
+
+#define PI_NO_TX_WAVE 9999
+#define PI_WAVE_MAX_PULSES 12000
+
+typedef struct {
+	uint32_t gpioOn;
+	uint32_t gpioOff;
+	uint32_t usDelay;
+} gpioPulse_t;
+
+int gpioInitialise(void);
+void gpioTerminate(void);
+int gpioSetMode(unsigned gpio, unsigned mode);
+int gpioRead(unsigned gpio);
+int gpioWrite(unsigned gpio, unsigned level);
+uint32_t gpioRead_Bits_0_31(void);
+int gpioWrite_Bits_0_31_Clear(uint32_t bits);
+int gpioWrite_Bits_0_31_Set(uint32_t bits);
+uint32_t gpioDelay(uint32_t micros);
+
+int spiOpen(unsigned spiChan, unsigned baud, unsigned spiFlags);
+int spiClose(unsigned handle);
+int spiRead(unsigned handle, char *buf, unsigned count);
+int spiWrite(unsigned handle, char *buf, unsigned count);
+
+int gpioWaveClear(void);
+int gpioWaveAddNew(void);
+int gpioWaveAddGeneric(unsigned numPulses, gpioPulse_t *pulses);
+int gpioWaveCreate(void);
+int gpioWaveDelete(unsigned wave_id);
+int gpioWaveTxSend(unsigned wave_id, unsigned wave_mode);
+int gpioWaveTxAt(void);
+int gpioWaveTxBusy(void);
+
+#endif